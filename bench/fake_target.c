@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define MAX_EPOLL_EVENTS 256
+#define UDP_FLAG (1ULL << 32)
+
+typedef enum bool {
+    false,
+    true
+} bool;
+
+const int LISTEN_BACKLOG = 4096;
+const char *DEFAULT_ADDRESS = "127.0.0.1";
+
+volatile sig_atomic_t stopRequested = 0;
+
+/*
+Function asks the event loop to stop.
+Params:
+    int sig     -       [The signal that arrived.]
+Returns nothing.
+*/
+void HandleStop(int sig) {
+    (void)sig;
+    stopRequested = 1;
+}
+
+/*
+Function opens a listener or a bound udp socket and prints the port it ended up on.
+Params:
+    int epfd                -       [Epoll instance that serves the socket.]
+    const char *address     -       [Ipv4 address to bind.]
+    int type                -       [SOCK_STREAM or SOCK_DGRAM.]
+    unsigned short port     -       [Port to bind, 0 lets the kernel pick.]
+    bool quiet              -       [Don't complain when the port is taken or privileged, the caller tries another.]
+Returns bool.
+*/
+bool OpenListener(int epfd, const char *address, int type, unsigned short port, bool quiet) {
+    int s = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(s < 0) return false;
+
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in local = {0};
+    socklen_t len = sizeof(local);
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    inet_pton(AF_INET, address, &local.sin_addr);
+    if(bind(s, (struct sockaddr*)&local, sizeof(local)) < 0 || (type == SOCK_STREAM && listen(s, LISTEN_BACKLOG) < 0) || getsockname(s, (struct sockaddr*)&local, &len) < 0) {
+        if(quiet == false || (errno != EADDRINUSE && errno != EACCES)) fprintf(stderr, "[Unable to bind %s port %hu: %s]\n", type == SOCK_STREAM ? "tcp" : "udp", port, strerror(errno));
+        close(s);
+        return false;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u64 = (unsigned long long)s | (type == SOCK_DGRAM ? UDP_FLAG : 0);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+    printf("%s %hu\n", type == SOCK_STREAM ? "tcp" : "udp", ntohs(local.sin_port));   // Ground truth for the benchmark.
+    return true;
+}
+
+/*
+Function opens the index-th of count listeners spread evenly over a port range, moving up past ports that are
+taken or privileged.
+Params:
+    int epfd                -       [Epoll instance that serves the socket.]
+    const char *address     -       [Ipv4 address to bind.]
+    int type                -       [SOCK_STREAM or SOCK_DGRAM.]
+    size_t first            -       [First port of the range.]
+    size_t last             -       [Last port of the range.]
+    size_t index            -       [Which listener this is.]
+    size_t count            -       [How many listeners share the range.]
+Returns bool (false once no port in the range is free).
+*/
+bool OpenListenerInRange(int epfd, const char *address, int type, size_t first, size_t last, size_t index, size_t count) {
+    size_t span = last - first + 1;
+    size_t offset = index * span / count;
+    for(size_t tried = 0; tried < span; tried++) {
+        if(OpenListener(epfd, address, type, (unsigned short)(first + (offset + tried) % span), true) == true) return true;
+    }
+    return false;
+}
+
+/*
+Function accepts every pending connection on a listener and closes it straight away.
+Params:
+    int s       -       [The listener.]
+Returns nothing.
+*/
+void DrainListener(int s) {
+    while(true) {
+        int client = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+        if(client < 0) break;
+        close(client);
+    }
+}
+
+/*
+Function answers every pending datagram with a short reply, so the port reads as open.
+Params:
+    int s       -       [The udp socket.]
+Returns nothing.
+*/
+void EchoDatagrams(int s) {
+    char buffer[2048];
+    struct sockaddr_storage peer;
+    while(true) {
+        socklen_t len = sizeof(peer);
+        if(recvfrom(s, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*)&peer, &len) < 0) break;
+        sendto(s, "ok", 2, MSG_DONTWAIT, (struct sockaddr*)&peer, len);
+    }
+}
+
+/*
+Function displays the help menu.
+Params:
+    None.
+Returns nothing.
+*/
+void ShowSyntax() {
+    printf(
+        "fake_target [ -a address ] [ -t count ] [ -u count ] [ -r first last ] [ port ... ]\n"
+        "    -a      <Ipv4 address to listen on (default 127.0.0.1)>\n"
+        "    -t      <Tcp listeners on ports picked by the kernel>\n"
+        "    -u      <Udp echo sockets on ports picked by the kernel>\n"
+        "    -r      <Spread the -t and -u ports over this range instead>\n"
+        "    port    <Extra tcp listeners on fixed ports>\n"
+        "Prints one 'tcp N' or 'udp N' line per open port, then 'ready', and serves until SIGINT or SIGTERM.\n"
+    );
+}
+
+int main(int argc, char *argv[]) {
+    const char *address = DEFAULT_ADDRESS;
+    size_t tcpCount = 0;
+    size_t udpCount = 0;
+    size_t first = 0;
+    size_t last = 0;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0) return 1;
+
+    struct rlimit limit;                                            // Every listener is a descriptor.
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    for(int index = 1; index < argc; index++) {
+        if(strcmp("-a", argv[index]) == 0 && index + 1 < argc) address = argv[++index];
+        else if(strcmp("-t", argv[index]) == 0 && index + 1 < argc) tcpCount = atoll(argv[++index]);
+        else if(strcmp("-u", argv[index]) == 0 && index + 1 < argc) udpCount = atoll(argv[++index]);
+        else if(strcmp("-r", argv[index]) == 0 && index + 2 < argc) {
+            first = atoll(argv[++index]);
+            last = atoll(argv[++index]);
+            if(first == 0 || first > last || last > 65535) {
+                ShowSyntax();
+                return 1;
+            }
+        }
+        else if(argv[index][0] != '-' && atoi(argv[index]) > 0 && atoi(argv[index]) < 65536) {
+            if(OpenListener(epfd, address, SOCK_STREAM, (unsigned short)atoi(argv[index]), false) == false) return 1;
+        }
+        else {
+            ShowSyntax();
+            return 1;
+        }
+    }
+
+    for(size_t index = 0; index < tcpCount; index++) {
+        if(first == 0 && OpenListener(epfd, address, SOCK_STREAM, 0, false) == false) return 1;
+        if(first != 0 && OpenListenerInRange(epfd, address, SOCK_STREAM, first, last, index, tcpCount) == false) {
+            fprintf(stderr, "[Only %lu tcp listeners fit in ports %lu-%lu]\n", index, first, last);
+            break;
+        }
+    }
+    for(size_t index = 0; index < udpCount; index++) {
+        if(first == 0 && OpenListener(epfd, address, SOCK_DGRAM, 0, false) == false) return 1;
+        if(first != 0 && OpenListenerInRange(epfd, address, SOCK_DGRAM, first, last, index, udpCount) == false) {
+            fprintf(stderr, "[Only %lu udp sockets fit in ports %lu-%lu]\n", index, first, last);
+            break;
+        }
+    }
+    printf("ready\n");
+    fflush(stdout);
+
+    signal(SIGINT, HandleStop);
+    signal(SIGTERM, HandleStop);
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while(stopRequested == 0) {
+        int count = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, 500);
+        for(int index = 0; index < count; index++) {
+            int s = (int)(events[index].data.u64 & 0xffffffff);
+            if(events[index].data.u64 & UDP_FLAG) EchoDatagrams(s);
+            else DrainListener(s);
+        }
+    }
+
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,189 @@
+#!/usr/bin/env bash
+# Loopback benchmark for linux_CPScan.
+#
+# Builds the scanner and bench/fake_target.c, starts the fake target, scans it in a few modes and reports
+# ports/sec, wall and cpu time, syscalls per probe (when strace is installed) and accuracy against the
+# ports the fake target really opened. Runs offline, only gcc and bash are required.
+#
+# With --netns (root) the target lives in its own network namespace behind a veth pair, so only its own
+# listeners are visible. --delay adds netem latency and --drop firewalls some listeners so they read as
+# filtered rather than open. It also runs syn-routes, a SYN scan of the target and 127.0.0.1 together, whose
+# probes leave from two different source addresses while a tbf on the link drops part of them, so only the
+# retransmits find every open port.
+
+set -u
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BUILD="${TMPDIR:-/tmp}/cpscan-bench.$$"
+START_PORT=1
+END_PORT=65535
+TCP_LISTENERS=200
+UDP_LISTENERS=50
+USE_NETNS=0
+DELAY_MS=0
+DROP_COUNT=0
+USE_STRACE=0
+RECORD_FILE=""
+EXTRA_ARGS=()
+
+NETNS=cpbench$$
+HOST_IF=cpb0$$
+TARGET_IF=cpb1$$
+HOST_ADDR=10.203.0.1
+TARGET_ADDR=127.0.0.1
+FAKE_PID=""
+
+usage() {
+    cat <<EOF
+run_bench.sh [options] [-- extra scanner arguments]
+    --ports START END   Port range to scan (default 1 65535)
+    --tcp N             Tcp listeners on the fake target (default 200)
+    --udp N             Udp echo sockets on the fake target (default 50)
+    --netns             Put the target in its own network namespace (root)
+    --delay MS          Netem delay on the target's link, needs --netns
+    --drop N            Drop traffic to N of the tcp listeners, needs --netns and nft or iptables
+    --strace            Also count syscalls per probe with strace -c (slow, separate run)
+    --record FILE       Append one csv line per scenario for regression tracking
+EOF
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --ports) START_PORT="$2"; END_PORT="$3"; shift 3 ;;
+        --tcp) TCP_LISTENERS="$2"; shift 2 ;;
+        --udp) UDP_LISTENERS="$2"; shift 2 ;;
+        --netns) USE_NETNS=1; shift ;;
+        --delay) DELAY_MS="$2"; shift 2 ;;
+        --drop) DROP_COUNT="$2"; shift 2 ;;
+        --strace) USE_STRACE=1; shift ;;
+        --record) RECORD_FILE="$2"; shift 2 ;;
+        --) shift; EXTRA_ARGS=("$@"); break ;;
+        -h|--help) usage; exit 0 ;;
+        *) usage; exit 1 ;;
+    esac
+done
+
+cleanup() {
+    [ -n "$FAKE_PID" ] && kill "$FAKE_PID" 2>/dev/null && wait "$FAKE_PID" 2>/dev/null
+    if [ "$USE_NETNS" = 1 ]; then
+        ip link del "$HOST_IF" 2>/dev/null
+        ip netns del "$NETNS" 2>/dev/null
+    fi
+    rm -rf "$BUILD"
+}
+trap cleanup EXIT
+
+# Runs a command inside the target's namespace when there is one.
+TARGET_PREFIX=()
+in_target() {
+    "${TARGET_PREFIX[@]}" "$@"
+}
+
+mkdir -p "$BUILD"
+gcc -O2 -pthread -o "$BUILD/linux_CPScan" "$ROOT/cpscan.c" "$ROOT/linux_CPScan.c" -lanl || exit 1
+gcc -O2 -o "$BUILD/fake_target" "$ROOT/bench/fake_target.c" || exit 1
+
+if [ "$USE_NETNS" = 1 ]; then
+    [ "$(id -u)" = 0 ] || { echo "--netns needs root"; exit 1; }
+    TARGET_ADDR=10.203.0.2
+    TARGET_PREFIX=(ip netns exec "$NETNS")
+    ip netns add "$NETNS" || exit 1
+    ip link add "$HOST_IF" type veth peer name "$TARGET_IF" || exit 1
+    ip link set "$TARGET_IF" netns "$NETNS"
+    ip addr add "$HOST_ADDR/24" dev "$HOST_IF"
+    ip link set "$HOST_IF" up
+    in_target ip addr add "$TARGET_ADDR/24" dev "$TARGET_IF"
+    in_target ip link set "$TARGET_IF" up
+    in_target ip link set lo up
+    in_target sysctl -qw net.ipv4.icmp_ratemask=0                  # Udp closed ports answer at full speed.
+    if [ "$DELAY_MS" != 0 ] && ! in_target tc qdisc add dev "$TARGET_IF" root netem delay "${DELAY_MS}ms" 2>/dev/null; then
+        echo "[netem is not available, running without added delay]"
+        DELAY_MS=0
+    fi
+elif [ "$DELAY_MS" != 0 ] || [ "$DROP_COUNT" != 0 ]; then
+    echo "--delay and --drop need --netns"
+    exit 1
+fi
+
+"${TARGET_PREFIX[@]}" "$BUILD/fake_target" -a "$TARGET_ADDR" -t "$TCP_LISTENERS" -u "$UDP_LISTENERS" -r "$START_PORT" "$END_PORT" > "$BUILD/ports" &
+FAKE_PID=$!
+for _ in $(seq 50); do grep -q '^ready' "$BUILD/ports" 2>/dev/null && break; sleep 0.1; done
+grep -q '^ready' "$BUILD/ports" || { echo "fake target did not start"; exit 1; }
+
+# Drop rules for the first --drop tcp listeners, they must not show up as open.
+awk '$1 == "tcp" {print $2}' "$BUILD/ports" | head -n "$DROP_COUNT" > "$BUILD/dropped"
+if [ "$DROP_COUNT" != 0 ]; then
+    if command -v nft >/dev/null; then
+        in_target nft add table inet cpbench
+        in_target nft add chain inet cpbench input '{ type filter hook input priority 0; }'
+        while read -r port; do in_target nft add rule inet cpbench input tcp dport "$port" drop; done < "$BUILD/dropped"
+    elif command -v iptables >/dev/null; then
+        while read -r port; do in_target iptables -A INPUT -p tcp --dport "$port" -j DROP; done < "$BUILD/dropped"
+    else
+        echo "[Neither nft nor iptables found, running without dropped ports]"
+        : > "$BUILD/dropped"
+    fi
+fi
+
+# Ground truth is every socket listening on the target address or the wildcard, not just the fake target's.
+listening_ports() {
+    local proto="$1" state="$2" want
+    want="$(printf '%02X%02X%02X%02X' $(echo "$TARGET_ADDR" | awk -F. '{print $4, $3, $2, $1}'))"
+    in_target cat "/proc/net/$proto" "/proc/net/${proto}6" 2>/dev/null | awk -v want="$want" -v state="$state" '
+        function hex(text,    value, i) {
+            value = 0
+            for(i = 1; i <= length(text); i++) value = value * 16 + index("0123456789ABCDEF", substr(text, i, 1)) - 1
+            return value
+        }
+        $4 == state {
+            split($2, local, ":")
+            if(local[1] == want || local[1] ~ /^0+$/) print hex(local[2])
+        }' | awk -v s="$START_PORT" -v e="$END_PORT" '$1 >= s && $1 <= e' | sort -u
+}
+listening_ports tcp 0A | grep -vxFf "$BUILD/dropped" > "$BUILD/truth.tcp"
+listening_ports udp 07 > "$BUILD/listening.udp"
+awk '$1 == "udp" {print $2}' "$BUILD/ports" | awk -v s="$START_PORT" -v e="$END_PORT" '$1 >= s && $1 <= e' | sort -u > "$BUILD/truth.udp"   # Other udp sockets may stay silent.
+
+PORTS=$((END_PORT - START_PORT + 1))
+COMMIT="$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+printf '%-14s %8s %8s %8s %8s %12s %10s %s\n' scenario ports wall_s user_s sys_s ports/s sys/probe accuracy
+
+# Runs one scan and prints its line of the report. Ports in truth must be found, ports outside allowed must not.
+run_scenario() {
+    local name="$1" truth="$2" allowed="$3"; shift 3
+    local args=("$TARGET_ADDR" -p "$START_PORT" "$END_PORT" -of json "$@" "${EXTRA_ARGS[@]}")
+    local wall user sys rate calls="-" found missed extra
+
+    TIMEFORMAT='%R %U %S'
+    { time "$BUILD/linux_CPScan" "${args[@]}" > "$BUILD/out.$name" 2>/dev/null; } 2> "$BUILD/time.$name"
+    read -r wall user sys < "$BUILD/time.$name"
+    rate="$(awk -v p="$PORTS" -v w="$wall" 'BEGIN {printf "%.0f", (w > 0 ? p / w : 0)}')"
+
+    if [ "$USE_STRACE" = 1 ] && command -v strace >/dev/null; then
+        strace -f -c -o "$BUILD/strace.$name" "$BUILD/linux_CPScan" "${args[@]}" > /dev/null 2>&1
+        calls="$(awk -v p="$PORTS" '$NF == "total" {printf "%.2f", $4 / p}' "$BUILD/strace.$name")"
+    fi
+
+    grep "\"ip\":\"$TARGET_ADDR\"" "$BUILD/out.$name" | grep '"state":"open"' | sed 's/.*"port":\([0-9]*\).*/\1/' | sort -u > "$BUILD/found.$name"   # comm wants lexical order.
+    found="$(wc -l < "$BUILD/found.$name")"
+    missed="$(comm -23 "$truth" "$BUILD/found.$name" | wc -l)"
+    extra="$(comm -13 "$allowed" "$BUILD/found.$name" | wc -l)"
+    printf '%-14s %8s %8s %8s %8s %12s %10s %s\n' "$name" "$PORTS" "$wall" "$user" "$sys" "$rate" "$calls" \
+        "$found open, $missed of $(wc -l < "$truth") missed, $extra false"
+    [ -n "$RECORD_FILE" ] && echo "$(date -u +%FT%TZ),$COMMIT,$name,$PORTS,$wall,$user,$sys,$rate,$calls,$missed,$extra" >> "$RECORD_FILE"
+}
+
+THREADS="$(nproc)"
+run_scenario connect "$BUILD/truth.tcp" "$BUILD/truth.tcp" -j 1
+[ "$THREADS" -gt 1 ] && run_scenario "connect-j$THREADS" "$BUILD/truth.tcp" "$BUILD/truth.tcp" -j "$THREADS"
+run_scenario udp "$BUILD/truth.udp" "$BUILD/listening.udp" -proto udp
+[ "$(id -u)" = 0 ] && run_scenario syn "$BUILD/truth.tcp" "$BUILD/truth.tcp" -sS -t 200
+if [ "$USE_NETNS" = 1 ]; then
+    if tc qdisc add dev "$HOST_IF" root tbf rate 20mbit burst 16k limit 16k 2>/dev/null; then
+        run_scenario syn-routes "$BUILD/truth.tcp" "$BUILD/truth.tcp" -sS -t 200 -r 8 127.0.0.1
+        tc qdisc del dev "$HOST_IF" root
+    else
+        echo "[tbf is not available, skipping syn-routes]"
+    fi
+fi
+exit 0
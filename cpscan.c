@@ -0,0 +1,3767 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <linux/errqueue.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include "cpscan.h"
+
+#define MAX_EPOLL_EVENTS 512
+#define OUTPUT_BUFFER_SIZE 262144
+#define OUTPUT_MAX_CHUNKS 64
+#define SYN_PACKET_SIZE 44
+#define SYN_RECEIVE_SIZE 128
+#define SYN_BATCH_SIZE 64
+#define SYN_UNROUTABLE 0xffffffffU
+#define RESOLVER_BATCH 64
+#define RESOLVER_EVENT ((unsigned long long)-1)
+#define UDP_EVENT ((unsigned long long)-2)
+#define BANNER_EVENT (1ULL << 62)
+#define UDP_BATCH_SIZE 64
+#define UDP_RECEIVE_SIZE 512
+#define UDP_CONTROL_SIZE 512
+#define RTT_HISTOGRAM_BUCKETS 24
+#define UDP_PAYLOAD_ENTRY(port, data) {port, sizeof(data) - 1, (const unsigned char*)data}
+#define BANNER_SIZE 256
+#define TCP_PROBE_ENTRY(port, data) {port, sizeof(data) - 1, (const unsigned char*)data}
+
+// Default constants.
+static const size_t DEFAULT_TIMEOUT = 50;
+static const size_t DEFAULT_CONCURRENCY = 4096;
+static const size_t RESERVED_DESCRIPTORS = 16;
+static const size_t DEFAULT_BANNER_WINDOW = 256;
+static const long long BANNER_WAIT = 1000000;
+static const long long MIN_RESOURCE_BACKOFF = 1000;
+static const long long MAX_RESOURCE_BACKOFF = 1000000;
+static const long long MAX_RESOURCE_STALL = 5000000;
+static const int PROGRESS_INTERVAL = 1000;
+static const int PERMUTATION_ROUNDS = 4;
+static const size_t DEFAULT_THREADS = 1;
+static const size_t MAX_THREADS = 256;
+static const size_t MAX_TARGETS = 1 << 20;
+static const unsigned long long MAX_RANGE_TARGETS = 1 << 16;
+static const size_t PORT_BLOCK_SIZE = 256;
+static const size_t DEFAULT_RETRIES = 1;
+static const size_t DEFAULT_WATCH_SLICES = 16;
+static const unsigned int WATCH_HOT_CYCLES = 4;
+static const size_t DEFAULT_RESOLVE_INTERVAL = 300;
+static const size_t MAX_RETRIES = 10;
+static const long long MIN_RTT_TIMEOUT = 5000;
+static const long long MAX_RTT_TIMEOUT = 10000000;
+static const long long RATE_TOLERANCE = 1000000;
+static const int UDP_MIN_GAP = 100;
+static const int UDP_MAX_GAP = 1000000;
+static const unsigned short SYN_SOURCE_PORT_BASE = 61000;
+static const unsigned short SYN_SOURCE_PORT_SPAN = 4000;
+
+// An array of colour codes.
+static const char *colours[] = {
+    "\x1B[1;30m", "\x1B[1;34m", "\x1B[1;32m", 
+    "\x1B[1;36m", "\x1B[1;31m", "\x1B[1;35m", 
+    "\x1B[1;33m", "\x1B[1;37m"
+};
+
+typedef struct UDP_PAYLOAD {   // Datagram sent to a well known udp port so the service answers.
+    unsigned short port;
+    unsigned short length;
+    const unsigned char *data;
+} UDP_PAYLOAD, *PUDP_PAYLOAD;
+
+// Services that ignore an empty datagram but answer a valid request. Every other port gets an empty one.
+static const UDP_PAYLOAD udpPayloads[] = {
+    UDP_PAYLOAD_ENTRY(53, "\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00" "\x00\x00\x02\x00\x01"),    // DNS, NS record of the root.
+    UDP_PAYLOAD_ENTRY(69, "\x00\x01" "cpscan.txt" "\x00" "octet" "\x00"),                                          // TFTP read request.
+    UDP_PAYLOAD_ENTRY(123, "\xe3\x00\x04\xfa\x00\x01\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00"            // NTP v4 client request.
+                           "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+                           "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"),
+    UDP_PAYLOAD_ENTRY(137, "\x12\x34\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x20" "CKAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"    // NetBIOS NBSTAT.
+                           "\x00\x00\x21\x00\x01"),
+    UDP_PAYLOAD_ENTRY(161, "\x30\x29\x02\x01\x00\x04\x06" "public" "\xa0\x1c\x02\x04\x12\x34\x56\x78\x02\x01\x00"  // SNMP v1 get sysDescr.
+                           "\x02\x01\x00\x30\x0e\x30\x0c\x06\x08\x2b\x06\x01\x02\x01\x01\x01\x00\x05\x00"),
+    UDP_PAYLOAD_ENTRY(1900, "M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMAN: \"ssdp:discover\"\r\nMX: 1\r\nST: ssdp:all\r\n\r\n"),
+    UDP_PAYLOAD_ENTRY(5353, "\x00\x00\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x09" "_services" "\x07" "_dns-sd"     // mDNS service listing.
+                            "\x04" "_udp" "\x05" "local" "\x00\x00\x0c\x00\x01"),
+    UDP_PAYLOAD_ENTRY(11211, "\x00\x00\x00\x00\x00\x01\x00\x00" "stats\r\n")                                   // Memcached.
+};
+
+typedef struct TCP_PROBE {     // Request sent on an open tcp port whose service waits for the client to speak first.
+    unsigned short port;
+    unsigned short length;
+    const unsigned char *data;
+} TCP_PROBE, *PTCP_PROBE;
+
+// Services that say nothing until asked. Every other port is given a moment to greet us, then a couple of blank lines.
+static const TCP_PROBE tcpProbes[] = {
+    TCP_PROBE_ENTRY(80, "HEAD / HTTP/1.0\r\n\r\n"),                        // HTTP, the Server header names the daemon.
+    TCP_PROBE_ENTRY(81, "HEAD / HTTP/1.0\r\n\r\n"),
+    TCP_PROBE_ENTRY(3000, "HEAD / HTTP/1.0\r\n\r\n"),
+    TCP_PROBE_ENTRY(5000, "HEAD / HTTP/1.0\r\n\r\n"),
+    TCP_PROBE_ENTRY(6379, "INFO server\r\n"),                                // Redis version, or an auth error.
+    TCP_PROBE_ENTRY(8000, "HEAD / HTTP/1.0\r\n\r\n"),
+    TCP_PROBE_ENTRY(8008, "HEAD / HTTP/1.0\r\n\r\n"),
+    TCP_PROBE_ENTRY(8080, "HEAD / HTTP/1.0\r\n\r\n"),
+    TCP_PROBE_ENTRY(8888, "HEAD / HTTP/1.0\r\n\r\n"),
+    TCP_PROBE_ENTRY(11211, "version\r\n")                                      // Memcached.
+};
+
+// Sent to a port with no entry above once it has stayed quiet for BANNER_WAIT.
+static const TCP_PROBE genericProbe = TCP_PROBE_ENTRY(0, "\r\n\r\n");
+
+typedef struct PROBE {          // A single connect attempt or udp datagram that is still in flight.
+    int fd;                     // Non blocking socket, -1 while the slot is free, for udp probes and for parked tcp retries.
+    size_t target;              // Index of the target in the job's list.
+    unsigned short port;        // Destination port.
+    unsigned char attempt;      // 0 for the first try, counts retransmits.
+    int sendGap;                // The host's udp send gap when the datagram went out.
+    long long sent;             // Monotonic time in microseconds when connect was called, 0 for a udp resend held back by pacing.
+    long long deadline;         // Monotonic time in microseconds when the probe gives up.
+    size_t heapIndex;           // Position of the probe in the deadline heap.
+    size_t next;                // Next udp probe in the same hash bucket.
+} PROBE, *PPROBE;
+
+typedef struct UDP_STATE {              // What a worker needs on top of the probe pool to scan udp.
+    int sockets[2];                     // Unconnected ipv4 and ipv6 sockets shared by every probe, -1 when unavailable.
+    unsigned short localPorts[2];       // Port each socket is bound to, in network byte order.
+    size_t *buckets;                    // Hash of in-flight probes keyed by destination address and port, SIZE_MAX when empty.
+    size_t bucketMask;
+    int sendSocket;                     // Socket the queued datagrams go out on.
+    unsigned int sendCount;             // Datagrams queued for the next sendmmsg.
+    size_t sendSlots[UDP_BATCH_SIZE];
+    CPSCAN_ADDRESS destinations[UDP_BATCH_SIZE];
+    struct iovec sendIov[UDP_BATCH_SIZE];
+    struct mmsghdr sendMsgs[UDP_BATCH_SIZE];
+    CPSCAN_ADDRESS sources[UDP_BATCH_SIZE];
+    struct iovec recvIov[UDP_BATCH_SIZE];
+    struct mmsghdr recvMsgs[UDP_BATCH_SIZE];
+    unsigned char buffers[UDP_BATCH_SIZE][UDP_RECEIVE_SIZE];
+    unsigned char control[UDP_BATCH_SIZE][UDP_CONTROL_SIZE];
+} UDP_STATE, *PUDP_STATE;
+
+typedef struct OUTPUT_CHUNK {           // A block of encoded results, filled by one thread and written by the writer.
+    struct OUTPUT_CHUNK *next;
+    size_t length;                      // Bytes used.
+    char data[OUTPUT_BUFFER_SIZE];
+} OUTPUT_CHUNK, *POUTPUT_CHUNK;
+
+typedef struct OUTPUT_WRITER {          // Writer thread that drains filled chunks with writev so scanners never block on output.
+    int fd;                             // Where the results go.
+    CPSCAN_FORMAT format;
+    bool colour;                        // Colour codes in human output, only on a terminal.
+    pthread_mutex_t lock;
+    pthread_cond_t queued;              // Chunks were queued or the writer should stop.
+    pthread_cond_t recycled;            // Written chunks are free again.
+    POUTPUT_CHUNK head;                 // Filled chunks in the order they were submitted.
+    POUTPUT_CHUNK tail;
+    POUTPUT_CHUNK spare;                // Written chunks ready to be reused.
+    size_t allocated;                   // Chunks in existence, capped at OUTPUT_MAX_CHUNKS.
+    bool stop;
+    bool running;                       // The thread started, otherwise chunks are written inline.
+    pthread_t thread;
+    unsigned long long written;         // Bytes written so far.
+    unsigned long long stalls;          // Times a scanner had to wait for a free chunk.
+} OUTPUT_WRITER, *POUTPUT_WRITER;
+
+typedef struct OUTPUT_BUFFER {
+    POUTPUT_WRITER writer;              // Where full chunks are handed off.
+    POUTPUT_CHUNK chunk;                // The chunk being filled, NULL until the first result.
+    PCPSCAN_METRICS metrics;            // Counters of the thread that owns the buffer, NULL if it keeps none.
+} OUTPUT_BUFFER, *POUTPUT_BUFFER;
+
+typedef struct RESULT_RECORD {          // One result in the binary format, 40 bytes in host byte order.
+    unsigned long long timestamp;       // Microseconds since the epoch.
+    unsigned char address[16];          // Ipv6 address, or the ipv4 address in the last 4 bytes.
+    unsigned int target;                // Index of the target in the order given.
+    int rtt;                            // Smoothed round trip time of the host in microseconds, 0 if unknown.
+    unsigned short port;
+    unsigned char family;               // 4 or 6.
+    unsigned char protocol;             // 0 tcp, 1 udp.
+    unsigned char state;                // CPSCAN_PORT_STATE.
+    unsigned char change;               // CPSCAN_CHANGE.
+    unsigned char reserved[2];
+} RESULT_RECORD, *PRESULT_RECORD;
+
+typedef struct STATE_HEADER {           // Start of a -state file, in host byte order. The target table and one bitmap per target follow.
+    char magic[8];                      // "CPSTATE1".
+    unsigned int headerSize;            // sizeof(STATE_HEADER).
+    unsigned int entrySize;             // sizeof(STATE_TARGET).
+    unsigned long long targetCount;
+    unsigned int portStart;             // The first port, bit pair 0 of every bitmap.
+    unsigned int portCount;
+    unsigned int protocol;              // 0 tcp, 1 udp.
+    unsigned int reserved;
+    unsigned long long tableOffset;     // Where the STATE_TARGET table starts.
+    unsigned long long bitmapOffset;    // Where the first bitmap starts, 64 byte aligned.
+    unsigned long long bitmapSize;      // Bytes per target, two bits per port, four ports per byte starting at the low bits.
+    unsigned long long created;         // Microseconds since the epoch.
+    unsigned long long updated;         // Last checkpoint.
+    unsigned long long finished;        // When a run last got through every port, 0 if none has.
+} STATE_HEADER, *PSTATE_HEADER;
+
+typedef struct STATE_TARGET {           // One target in a -state file, in the order they were given.
+    unsigned long long nameHash;        // Hash of the hostname, 0 for a literal address.
+    unsigned char address[16];          // Ipv6 address, or the ipv4 address in the last 4 bytes, zero until resolved.
+    unsigned char family;               // 4 or 6, 0 until resolved.
+    unsigned char reserved[7];
+} STATE_TARGET, *PSTATE_TARGET;
+
+typedef enum stateCell {                // What the two bits of a port in a -state bitmap mean.
+    cellUnknown,                        // Not decided yet.
+    cellOpen,
+    cellClosed,
+    cellSilent                          // No answer: filtered for tcp, open|filtered for udp.
+} stateCell;
+
+typedef struct RATE_LIMIT {             // GCRA token bucket, a single atomic timestamp so every thread can share it.
+    long long interval;                 // Nanoseconds between probes, 0 when unlimited.
+    long long tolerance;                // How far ahead of schedule a probe may go out, bounds the burst size.
+    long long tat;                      // Theoretical arrival time of the next probe in nanoseconds.
+} RATE_LIMIT, *PRATE_LIMIT;
+
+typedef struct BANNER_READ {            // An open connection whose banner is being read.
+    int fd;                             // The connected socket, -1 while the slot is free.
+    size_t target;                      // Index of the target in the job's list.
+    unsigned short port;
+    bool probed;                        // A request went out, so the next quiet BANNER_WAIT ends the read.
+    long long deadline;                 // Monotonic time in microseconds when the current wait runs out.
+    size_t prev;                        // Neighbours in deadline order, SIZE_MAX at either end.
+    size_t next;
+} BANNER_READ, *PBANNER_READ;
+
+typedef struct BANNER_STAGE {           // Banner reads that run behind the connect probes with a window of their own.
+    PBANNER_READ reads;                 // Fixed pool of read slots.
+    size_t *freeSlots;                  // Stack of unused read slots.
+    size_t freeCount;
+    size_t window;
+    size_t head;                        // Read with the earliest deadline, SIZE_MAX when idle. Every wait is
+    size_t tail;                        // BANNER_WAIT long, so appending keeps the list in deadline order.
+    unsigned char buffer[BANNER_SIZE];
+} BANNER_STAGE, *PBANNER_STAGE;
+
+typedef struct SCAN_ENGINE {
+    int epfd;                           // Epoll instance watching every in-flight socket.
+    PCPSCAN_JOB job;                    // The job this engine pulls work from.
+    PCPSCAN_CONFIG config;              // Protocol and timeout shared by all probes.
+    PPROBE probes;                      // Fixed pool of probe slots, one per window entry.
+    size_t *freeSlots;                  // Stack of unused probe slots.
+    size_t freeCount;
+    size_t *heap;                       // Min-heap of probe slots ordered by deadline.
+    size_t heapSize;
+    size_t window;                      // Maximum number of probes in flight.
+    size_t limit;                       // Current cap on probes in flight, shrinks below window when descriptors or source ports run out.
+    long long backoff;                  // Microseconds to wait after the last resource failure, 0 when launches succeed.
+    long long stalledSince;             // When launches began failing with nothing in flight, 0 once a socket is created.
+    bool socketReported;                // "INVALID SOCKET" has been shown, once per engine is enough.
+    size_t chunkNext;                   // Next probe index to launch from the claimed block.
+    size_t chunkEnd;                    // End of the claimed block.
+    bool exhausted;                     // Set once the job has no blocks left.
+    bool waiting;                       // The next probe's target is still resolving.
+    long long resumeAt;                 // When the next probe may go out under the rate limits, 0 if not paced.
+    PUDP_STATE udp;                     // Udp sockets and batches, NULL for tcp scans.
+    PBANNER_STAGE banners;              // Banner reads on open ports, NULL unless -banners.
+    OUTPUT_BUFFER output;               // This worker's pending results.
+    PCPSCAN_METRICS metrics;            // This worker's counters.
+} SCAN_ENGINE, *PSCAN_ENGINE;
+
+typedef struct SYN_SCANNER {
+    PCPSCAN_JOB job;                    // Targets, port range and output lock.
+    PCPSCAN_CONFIG config;              // Timeout and debug flag.
+    int routeSocket;                    // Udp socket used to look up our source address per target.
+    int sendSocket;                     // Raw socket the crafted SYNs are written to.
+    int recvSocket;                     // Raw socket the SYN-ACK and RST replies are read from.
+    unsigned int sourceAddress;         // Our address in network byte order, the one the template carries.
+    unsigned int *sources;              // Per target, our address on its route, 0 until prepared, SYN_UNROUTABLE if it cannot be probed.
+    unsigned short sourcePort;          // Fixed source port every probe is sent from.
+    unsigned long long secret;          // Keys the sequence number cookies.
+    unsigned char packet[SYN_PACKET_SIZE];  // Template every probe is copied from.
+    unsigned int templateSum;           // Checksum of the template before the port and sequence are set.
+    unsigned char *answered;            // One bit per probe index, set once a valid reply arrived.
+    size_t answeredSize;                // Bytes mapped for the answered bitmap.
+    unsigned int *addressKeys;          // Insert-only map from ipv4 address to target, written by the sender only.
+    unsigned int *addressTargets;       // The first target with each address.
+    unsigned int *sameAddress;          // Per target, the next target with the same address, 0 ends the chain.
+    size_t addressMapSize;              // Power of two.
+    size_t skipped;                     // Ipv6 targets the sender had to leave out.
+    bool stop;                          // Tells the receiver the sender is done.
+    OUTPUT_BUFFER output;               // The receiver's pending results.
+    PCPSCAN_METRICS metrics;            // The sender's counters, the receiver counts through its output buffer.
+} SYN_SCANNER, *PSYN_SCANNER;
+
+typedef struct SCAN_MONITOR {           // Thread that prints progress, checkpoints the -state file and dumps the metrics on a signal.
+    PCPSCAN_JOB job;
+    int stopEvent;                      // Eventfd poked once the scan is over.
+    int signalFd;                       // Delivers the metrics signal, which every scan thread keeps blocked. -1 without one.
+    bool running;
+    pthread_t thread;
+} SCAN_MONITOR, *PSCAN_MONITOR;
+
+struct CPSCAN_WATCH {                   // Results carried from one watch cycle to the next.
+    PCPSCAN_CONFIG config;
+    PCPSCAN_TARGET_LIST targets;
+    size_t portStart;
+    size_t portEnd;
+    unsigned char *cells;               // Two bits per probe index laid out like a -state bitmap, mapped on demand.
+    size_t cellsSize;
+    unsigned int *lastChange;           // Per target, the last cycle one of its ports opened or closed, 0 for never.
+    unsigned int cycle;                 // The next cycle to scan, 0 is the full baseline.
+    long long resolvedAt;               // Monotonic time in microseconds host names were last looked up.
+};
+
+struct CPSCAN_JOB {                     // State shared by every thread of a scan.
+    PCPSCAN_CONFIG config;              // Protocol and timeout shared by all probes.
+    PCPSCAN_TARGET_LIST targets;        // Hosts to scan, some may still be resolving.
+    size_t pendingNames;                // Host names this scan has to look up, repeats not counted.
+    size_t portStart;                   // The first port to scan.
+    size_t portCount;                   // Number of ports in the range.
+    size_t totalProbes;                 // Targets times ports, the size of the index space.
+    size_t nextIndex;                   // Next unclaimed probe index, advanced atomically one block at a time.
+    int wakeEvent;                      // Eventfd poked whenever a target changes state or a scan thread finishes.
+    RATE_LIMIT rate;                    // Global pace set by -rate.
+    int hostGap;                        // Microseconds between probes to one host set by -hrate, 0 when unlimited.
+    OUTPUT_WRITER output;               // Streams the results to config->outputFd.
+    POUTPUT_WRITER writer;              // The output stream the threads hand their results to, NULL when only the callback gets them.
+    PCPSCAN_METRICS metrics;            // One block of counters per thread, summed whenever they are read.
+    size_t metricsCount;
+    unsigned int *rttHistograms;        // RTT_HISTOGRAM_BUCKETS log2 buckets of round trip times per target, mapped on demand.
+    size_t rttHistogramsSize;
+    long long started;                  // Monotonic time in microseconds when the scan began.
+    PSTATE_HEADER state;                // Mapped -state file, NULL when not checkpointing.
+    size_t stateSize;
+    unsigned int permutationBits;       // Width of each Feistel half, 0 to probe in order.
+    unsigned long long permutationKeys[4];  // Round keys of the probe order permutation.
+    SCAN_MONITOR monitor;               // Progress line, checkpoints and metrics dumps.
+    pthread_t resolver;
+    bool resolving;                     // The resolver thread is running.
+    PSCAN_ENGINE engines;               // One per worker, engine zero runs on the thread driving the scan.
+    pthread_t *workers;
+    size_t engineCount;
+    PSYN_SCANNER syn;                   // The raw SYN scan, NULL when scanning with the engines.
+    pthread_t synThread;
+    unsigned int activeThreads;         // Worker and SYN threads still scanning, read and written atomically.
+    bool stepping;                      // Engine zero still has work.
+    bool running;                       // StartScan succeeded and FinishScan has not run yet.
+    int pollFd;                         // Epoll instance watching wakeEvent, GetScanFd's answer once engine zero is done.
+    sigset_t signals;                   // The metrics signal, blocked while the scan runs.
+    sigset_t previousMask;              // The mask to restore when it is over.
+    PCPSCAN_WATCH watch;                // The watch this scan is a cycle of, NULL for a one off scan.
+    unsigned int watchCycle;            // Which cycle.
+};
+
+// Forward declarations.
+static long long GetMonotonicTime();
+static bool InitScanEngine(PSCAN_ENGINE engine, PCPSCAN_JOB job, size_t window, PCPSCAN_METRICS metrics);
+static void FreeScanEngine(PSCAN_ENGINE engine);
+static bool LaunchProbe(PSCAN_ENGINE engine, size_t target, unsigned short port, unsigned char attempt);
+static bool LaunchUdpProbe(PSCAN_ENGINE engine, size_t target, unsigned short port);
+static void CompleteProbe(PSCAN_ENGINE engine, size_t slot, CPSCAN_PORT_STATE state);
+static bool EngineStep(PSCAN_ENGINE engine, bool block);
+static void *ResolverThread(void *arg);
+static size_t HashName(const char *name);
+
+/*
+Function returns a colours codes as selected by the user.
+Params:
+    bool enabled    -       [Whether the text is headed for a terminal that shows colour.]
+    CPSCAN_COLOUR c -       [The colour code.]
+Returns const char*
+*/
+static const char *clr(bool enabled, CPSCAN_COLOUR c) {
+    if(enabled == false) return "";
+    else if(c == CPSCAN_GREY) return colours[0];
+    else if(c == CPSCAN_BLUE) return colours[1];
+    else if(c == CPSCAN_GREEN) return colours[2];
+    else if(c == CPSCAN_LIGHT_BLUE) return colours[3];
+    else if(c == CPSCAN_RED) return colours[4];
+    else if(c == CPSCAN_PURPLE) return colours[5];
+    else if(c == CPSCAN_ORANGE) return colours[6];
+    else if(c == CPSCAN_WHITE) return colours[7];
+    else return "";
+}
+
+/*
+Function prints a coloured notice on its own line to the scan's message stream.
+Params:
+    PCPSCAN_CONFIG config       -       [Where notices go and whether they are coloured, NULL to drop the notice.]
+    CPSCAN_COLOUR c             -       [The colour of the notice.]
+    const char *format          -       [printf style format string, without the trailing newline.]
+Returns nothing.
+*/
+void ReportNotice(PCPSCAN_CONFIG config, CPSCAN_COLOUR c, const char *format, ...) {
+    if(!config || !config->messages) return;
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    fprintf(config->messages, "%s%s%s\n", clr(config->colour, c), text, CPSCAN_DEFAULT_COLOUR(config->colour));     // One call, so lines from two threads never mix.
+    fflush(config->messages);                                       // The writer thread bypasses stdio, don't let a notice lag behind it.
+}
+
+/*
+Function returns the current monotonic time.
+Params:
+    None.
+Returns long long (microseconds).
+*/
+static long long GetMonotonicTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+Function swaps two entries in the deadline heap and keeps their back references up to date.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that owns the heap.]
+    size_t a                -       [First heap position.]
+    size_t b                -       [Second heap position.]
+Returns nothing.
+*/
+static void HeapSwap(PSCAN_ENGINE engine, size_t a, size_t b) {
+    size_t tmp = engine->heap[a];
+    engine->heap[a] = engine->heap[b];
+    engine->heap[b] = tmp;
+    engine->probes[engine->heap[a]].heapIndex = a;
+    engine->probes[engine->heap[b]].heapIndex = b;
+}
+
+/*
+Function restores the heap order by moving an entry towards the root.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that owns the heap.]
+    size_t index            -       [The heap position to sift.]
+Returns nothing.
+*/
+static void HeapSiftUp(PSCAN_ENGINE engine, size_t index) {
+    while(index > 0) {
+        size_t parent = (index - 1) / 2;
+        if(engine->probes[engine->heap[parent]].deadline <= engine->probes[engine->heap[index]].deadline) break;
+        HeapSwap(engine, parent, index);
+        index = parent;
+    }
+}
+
+/*
+Function restores the heap order by moving an entry towards the leaves.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that owns the heap.]
+    size_t index            -       [The heap position to sift.]
+Returns nothing.
+*/
+static void HeapSiftDown(PSCAN_ENGINE engine, size_t index) {
+    while(true) {
+        size_t smallest = index;
+        size_t left = index * 2 + 1;
+        size_t right = left + 1;
+        if(left < engine->heapSize && engine->probes[engine->heap[left]].deadline < engine->probes[engine->heap[smallest]].deadline) smallest = left;
+        if(right < engine->heapSize && engine->probes[engine->heap[right]].deadline < engine->probes[engine->heap[smallest]].deadline) smallest = right;
+        if(smallest == index) break;
+        HeapSwap(engine, index, smallest);
+        index = smallest;
+    }
+}
+
+/*
+Function removes a probe from the deadline heap.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that owns the heap.]
+    size_t index            -       [The heap position of the probe.]
+Returns nothing.
+*/
+static void HeapRemove(PSCAN_ENGINE engine, size_t index) {
+    engine->heapSize--;
+    if(index == engine->heapSize) return;
+    HeapSwap(engine, index, engine->heapSize);
+    HeapSiftUp(engine, index);
+    HeapSiftDown(engine, index);
+}
+
+/*
+Function gets an empty chunk for a worker to fill, waiting for the writer when too many are queued.
+Params:
+    POUTPUT_WRITER writer       -       [The writer that owns the chunks.]
+Returns POUTPUT_CHUNK (NULL when memory runs out).
+*/
+static POUTPUT_CHUNK GetOutputChunk(POUTPUT_WRITER writer) {
+    pthread_mutex_lock(&writer->lock);
+    if(!writer->spare && writer->allocated >= OUTPUT_MAX_CHUNKS) __atomic_store_n(&writer->stalls, writer->stalls + 1, __ATOMIC_RELAXED);
+    while(!writer->spare && writer->allocated >= OUTPUT_MAX_CHUNKS) pthread_cond_wait(&writer->recycled, &writer->lock);   // Back pressure from a slow reader.
+    POUTPUT_CHUNK chunk = writer->spare;
+    if(chunk) writer->spare = chunk->next;
+    else if((chunk = malloc(sizeof(OUTPUT_CHUNK)))) writer->allocated++;
+    pthread_mutex_unlock(&writer->lock);
+
+    if(chunk) {
+        chunk->next = NULL;
+        chunk->length = 0;
+    }
+    return chunk;
+}
+
+/*
+Function writes a list of chunks to the output descriptor with as few writev calls as possible.
+Params:
+    int fd                  -       [Where the results go.]
+    POUTPUT_CHUNK chunks    -       [The chunks in order.]
+Returns size_t (bytes written).
+*/
+static size_t WriteOutputChunks(int fd, POUTPUT_CHUNK chunks) {
+    struct iovec iov[OUTPUT_MAX_CHUNKS];
+    int count = 0;
+    for(POUTPUT_CHUNK chunk = chunks; chunk && count < OUTPUT_MAX_CHUNKS; chunk = chunk->next) {
+        iov[count].iov_base = chunk->data;
+        iov[count++].iov_len = chunk->length;
+    }
+
+    int first = 0;
+    size_t total = 0;
+    while(first < count) {
+        ssize_t written = writev(fd, iov + first, count - first);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) break;                                     // Reader went away, drop the rest.
+        total += written;
+        while(first < count && (size_t)written >= iov[first].iov_len) written -= iov[first++].iov_len;
+        if(first < count) {
+            iov[first].iov_base = (char*)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+    return total;
+}
+
+/*
+Function hands a filled chunk to the writer thread.
+Params:
+    POUTPUT_WRITER writer       -       [The writer.]
+    POUTPUT_CHUNK chunk         -       [The chunk, owned by the writer from now on.]
+Returns nothing.
+*/
+static void SubmitOutputChunk(POUTPUT_WRITER writer, POUTPUT_CHUNK chunk) {
+    pthread_mutex_lock(&writer->lock);
+    if(writer->running == false) {                                  // No writer thread, write it ourselves.
+        __atomic_store_n(&writer->written, writer->written + WriteOutputChunks(writer->fd, chunk), __ATOMIC_RELAXED);
+        chunk->next = writer->spare;
+        writer->spare = chunk;
+    }
+    else {
+        if(writer->tail) writer->tail->next = chunk;
+        else writer->head = chunk;
+        writer->tail = chunk;
+        pthread_cond_signal(&writer->queued);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/*
+Function is the writer thread: it takes every queued chunk at once and writes them with one writev.
+Params:
+    void *arg       -       [The POUTPUT_WRITER.]
+Returns void*.
+*/
+static void *OutputWriterThread(void *arg) {
+    POUTPUT_WRITER writer = (POUTPUT_WRITER)arg;
+    pthread_mutex_lock(&writer->lock);
+    while(true) {
+        while(!writer->head && writer->stop == false) pthread_cond_wait(&writer->queued, &writer->lock);
+        if(!writer->head) break;
+
+        POUTPUT_CHUNK chunks = writer->head;
+        writer->head = writer->tail = NULL;
+        pthread_mutex_unlock(&writer->lock);
+        size_t written = WriteOutputChunks(writer->fd, chunks);
+
+        pthread_mutex_lock(&writer->lock);
+        __atomic_store_n(&writer->written, writer->written + written, __ATOMIC_RELAXED);
+        while(chunks) {                                             // Hand the chunks back for reuse.
+            POUTPUT_CHUNK next = chunks->next;
+            chunks->next = writer->spare;
+            writer->spare = chunks;
+            chunks = next;
+        }
+        pthread_cond_broadcast(&writer->recycled);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/*
+Function sets up the output writer and starts its thread.
+Params:
+    POUTPUT_WRITER writer       -       [The writer to initialise.]
+    int fd                      -       [Where the results go.]
+    CPSCAN_FORMAT format        -       [How results are encoded.]
+Returns nothing.
+*/
+static void StartOutputWriter(POUTPUT_WRITER writer, int fd, CPSCAN_FORMAT format) {
+    memset(writer, 0, sizeof(OUTPUT_WRITER));
+    writer->fd = fd;
+    writer->format = format;
+    writer->colour = format == CPSCAN_FORMAT_HUMAN && isatty(fd) == 1; // No escape codes in pipes and files.
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->recycled, NULL);
+    writer->running = pthread_create(&writer->thread, NULL, OutputWriterThread, writer) == 0;
+}
+
+/*
+Function waits for the writer to drain, stops its thread and frees the chunks.
+Params:
+    POUTPUT_WRITER writer       -       [The writer to tear down.]
+Returns nothing.
+*/
+static void StopOutputWriter(POUTPUT_WRITER writer) {
+    if(writer->running == true) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stop = true;
+        pthread_cond_signal(&writer->queued);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+    }
+    while(writer->spare) {
+        POUTPUT_CHUNK next = writer->spare->next;
+        free(writer->spare);
+        writer->spare = next;
+    }
+    pthread_cond_destroy(&writer->queued);
+    pthread_cond_destroy(&writer->recycled);
+    pthread_mutex_destroy(&writer->lock);
+}
+
+/*
+Function passes a buffer's pending results to the writer.
+Params:
+    POUTPUT_BUFFER out      -       [The buffer to flush.]
+Returns nothing.
+*/
+static void FlushOutput(POUTPUT_BUFFER out) {
+    if(!out->chunk || out->chunk->length == 0) return;
+    SubmitOutputChunk(out->writer, out->chunk);
+    out->chunk = NULL;
+}
+
+/*
+Function makes sure an output buffer has room for a number of bytes.
+Params:
+    POUTPUT_BUFFER out      -       [The buffer to append to.]
+    size_t length           -       [Bytes about to be appended.]
+Returns bool (false when no memory is left and the output has to be dropped).
+*/
+static bool ReserveOutput(POUTPUT_BUFFER out, size_t length) {
+    if(out->chunk && out->chunk->length + length < OUTPUT_BUFFER_SIZE) return true;
+    FlushOutput(out);
+    out->chunk = GetOutputChunk(out->writer);
+    return out->chunk != NULL;
+}
+
+/*
+Function appends a formatted line to an output buffer.
+Params:
+    POUTPUT_BUFFER out      -       [The buffer to append to.]
+    const char *format      -       [printf style format string.]
+    va_list args            -       [The format arguments.]
+Returns nothing.
+*/
+static void AppendOutputList(POUTPUT_BUFFER out, const char *format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int length = out->chunk ? vsnprintf(out->chunk->data + out->chunk->length, OUTPUT_BUFFER_SIZE - out->chunk->length, format, copy) : -1;
+    va_end(copy);
+
+    if(length < 0 || out->chunk->length + length >= OUTPUT_BUFFER_SIZE) {  // Did not fit, make room and format again.
+        if(ReserveOutput(out, OUTPUT_BUFFER_SIZE - 1) == false) return;
+        length = vsnprintf(out->chunk->data, OUTPUT_BUFFER_SIZE, format, args);
+        if(length < 0 || (size_t)length >= OUTPUT_BUFFER_SIZE) return;
+    }
+    out->chunk->length += length;
+}
+
+/*
+Function appends a formatted line to an output buffer.
+Params:
+    POUTPUT_BUFFER out      -       [The buffer to append to.]
+    const char *format      -       [printf style format string.]
+Returns nothing.
+*/
+static void AppendOutput(POUTPUT_BUFFER out, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    AppendOutputList(out, format, args);
+    va_end(args);
+}
+
+/*
+Function reports a notice that is not a port result. It stays in line with the results when both go to a
+terminal, otherwise it goes to the message stream so machine readable output stays clean.
+Params:
+    POUTPUT_BUFFER out          -       [The caller's result buffer.]
+    PCPSCAN_CONFIG config       -       [Where notices go.]
+    const char *format          -       [printf style format string.]
+Returns nothing.
+*/
+static void ReportMessage(POUTPUT_BUFFER out, PCPSCAN_CONFIG config, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if(out->writer && config->messages == stdout && out->writer->fd == STDOUT_FILENO) AppendOutputList(out, format, args);
+    else if(config->messages) vfprintf(config->messages, format, args);
+    va_end(args);
+}
+
+/*
+Function reports a notice from a scanning thread. Like ReportMessage it is queued behind the thread's results
+when both go to the same terminal, so the two streams never interleave.
+Params:
+    POUTPUT_BUFFER out          -       [The caller's result buffer.]
+    PCPSCAN_CONFIG config       -       [Where notices go.]
+    CPSCAN_COLOUR c             -       [Colour of the notice.]
+    const char *format          -       [printf style format string, without the newline.]
+Returns nothing.
+*/
+static void ReportOutputNotice(POUTPUT_BUFFER out, PCPSCAN_CONFIG config, CPSCAN_COLOUR c, const char *format, ...) {
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    ReportMessage(out, config, "%s%s%s\n", clr(config->colour, c), text, CPSCAN_DEFAULT_COLOUR(config->colour));
+}
+
+/*
+Function copies text into a json string body, escaping quotes, backslashes and control characters.
+Params:
+    const char *text        -       [The text to escape.]
+    char *output            -       [The escaped text, always terminated.]
+    size_t size             -       [Size of the output buffer.]
+Returns nothing.
+*/
+static void EscapeJson(const char *text, char *output, size_t size) {
+    size_t length = 0;
+    for(; *text && length + 7 < size; text++) {
+        unsigned char c = (unsigned char)*text;
+        if(c == '"' || c == '\\') {
+            output[length++] = '\\';
+            output[length++] = c;
+        }
+        else if(c < 0x20) length += snprintf(output + length, size - length, "\\u%04x", c);
+        else output[length++] = c;
+    }
+    output[length] = '\0';
+}
+
+/*
+Function turns the raw bytes of a banner into one printable line. Tabs and line breaks become \t, \r and \n,
+anything else unprintable becomes \xNN, or \u00NN in json so the string stays valid.
+Params:
+    const unsigned char *data   -       [The banner.]
+    size_t length               -       [Bytes in the banner.]
+    bool json                   -       [Escape for a json string instead of a terminal.]
+    char *output                -       [The escaped text, always terminated.]
+    size_t size                 -       [Size of the output buffer.]
+Returns nothing.
+*/
+static void EscapeBanner(const unsigned char *data, size_t length, bool json, char *output, size_t size) {
+    size_t used = 0;
+    for(size_t index = 0; index < length && used + 7 < size; index++) {
+        unsigned char c = data[index];
+        if(c == '\\' || (c == '"' && json == true)) {
+            output[used++] = '\\';
+            output[used++] = c;
+        }
+        else if(c == '\r' || c == '\n' || c == '\t') {
+            output[used++] = '\\';
+            output[used++] = c == '\r' ? 'r' : (c == '\n' ? 'n' : 't');
+        }
+        else if(c < 0x20 || c >= 0x7f) used += snprintf(output + used, size - used, json == true ? "\\u%04x" : "\\x%02x", c);
+        else output[used++] = c;
+    }
+    output[used] = '\0';
+}
+
+/*
+Function returns the wall clock time.
+Params:
+    None.
+Returns long long (microseconds since the epoch).
+*/
+static long long GetWallTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+Function adds to a counter owned by the calling thread. Only the owner writes it, so a relaxed load and
+store is enough and counting never needs a locked instruction.
+Params:
+    unsigned long long *counter     -       [The counter.]
+    unsigned long long amount       -       [What to add.]
+Returns nothing.
+*/
+static void CountMetric(unsigned long long *counter, unsigned long long amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/*
+Function counts a failed syscall by its errno.
+Params:
+    PCPSCAN_METRICS metrics -       [The calling thread's counters.]
+    int err                 -       [The errno value.]
+Returns nothing.
+*/
+static void CountError(PCPSCAN_METRICS metrics, int err) {
+    if(err > 0 && err < CPSCAN_ERRNO_LIMIT) CountMetric(&metrics->errors[err], 1);
+}
+
+/*
+Function copies a target's address into the fixed 16 byte form used by binary records and the -state file.
+Params:
+    PCPSCAN_TARGET host         -       [The target.]
+    unsigned char *address      -       [16 bytes, ipv4 lands in the last 4.]
+Returns unsigned char (4 or 6, 0 when the target has no address yet).
+*/
+static unsigned char PackTargetAddress(PCPSCAN_TARGET host, unsigned char *address) {
+    memset(address, 0, 16);
+    if(host->address.sa.sa_family == AF_INET) memcpy(address + 12, &host->address.v4.sin_addr, 4);
+    else if(host->address.sa.sa_family == AF_INET6) memcpy(address, &host->address.v6.sin6_addr, 16);
+    else return 0;
+    return host->address.sa.sa_family == AF_INET ? 4 : 6;
+}
+
+/*
+Function finds the bitmap byte holding a probe's result in the -state file.
+Params:
+    PCPSCAN_JOB job         -       [The scan, with a mapped state file.]
+    size_t index            -       [The probe index, target times ports plus port offset.]
+    int *shift              -       [Set to the position of the port's two bits in the byte.]
+Returns unsigned char*.
+*/
+static unsigned char *StateCell(PCPSCAN_JOB job, size_t index, int *shift) {
+    size_t port = index % job->portCount;
+    *shift = (int)(port % 4) * 2;
+    return (unsigned char*)job->state + job->state->bitmapOffset + index / job->portCount * job->state->bitmapSize + port / 4;
+}
+
+/*
+Function records a probe's result in the -state file. Workers share bytes, so the bits are set atomically.
+Params:
+    PCPSCAN_JOB job         -       [The scan, with a mapped state file.]
+    size_t target           -       [Index of the target.]
+    unsigned short port     -       [The port.]
+    CPSCAN_PORT_STATE state -       [What the probe found.]
+Returns nothing.
+*/
+static void RecordPortState(PCPSCAN_JOB job, size_t target, unsigned short port, CPSCAN_PORT_STATE state) {
+    int shift;
+    unsigned char *cell = StateCell(job, target * job->portCount + (port - job->portStart), &shift);
+    unsigned char value = state == CPSCAN_PORT_OPEN ? cellOpen : (state == CPSCAN_PORT_CLOSED ? cellClosed : cellSilent);
+    __atomic_fetch_or(cell, (unsigned char)(value << shift), __ATOMIC_RELAXED);
+}
+
+/*
+Function finds the byte holding a probe's last result in a watch.
+Params:
+    PCPSCAN_WATCH watch     -       [The watch.]
+    size_t index            -       [The probe index.]
+    int *shift              -       [Set to the position of the port's two bits in the byte.]
+Returns unsigned char*.
+*/
+static unsigned char *WatchCell(PCPSCAN_WATCH watch, size_t index, int *shift) {
+    *shift = (int)(index % 4) * 2;
+    return watch->cells + index / 4;
+}
+
+/*
+Function tells whether a watch cycle can leave a probe out. Ports that were open, ports without a result yet
+(their host did not resolve) and every port of a host that changed in the last few cycles are rescanned each
+time. The rest, closed and silent alike, go in turn, one strided slice of the range per cycle, so a newly opened
+port is found within watchSlices cycles.
+Params:
+    PCPSCAN_JOB job         -       [A scan of a watch.]
+    size_t index            -       [The probe index.]
+Returns bool.
+*/
+static bool IsPortSettled(PCPSCAN_JOB job, size_t index) {
+    if(job->watchCycle == 0) return false;                                          // The baseline covers everything.
+    int shift;
+    unsigned char *cell = WatchCell(job->watch, index, &shift);
+    unsigned char last = __atomic_load_n(cell, __ATOMIC_RELAXED) >> shift & 3;
+    if(last == cellUnknown || last == cellOpen) return false;
+
+    unsigned int changed = __atomic_load_n(&job->watch->lastChange[index / job->portCount], __ATOMIC_RELAXED);
+    if(changed != 0 && job->watchCycle - changed < WATCH_HOT_CYCLES) return false;   // Busy hosts get a full sweep.
+    return index % job->portCount % job->config->watchSlices != job->watchCycle % job->config->watchSlices;
+}
+
+/*
+Function stores a watch cycle's result for a port and tells how it differs from the last one.
+Params:
+    PCPSCAN_JOB job         -       [A scan of a watch.]
+    size_t target           -       [Index of the target.]
+    unsigned short port     -       [The port.]
+    CPSCAN_PORT_STATE state -       [What the probe found.]
+Returns CPSCAN_CHANGE (CPSCAN_CHANGE_NONE during the baseline).
+*/
+static CPSCAN_CHANGE RecordWatchState(PCPSCAN_JOB job, size_t target, unsigned short port, CPSCAN_PORT_STATE state) {
+    int shift;
+    unsigned char *cell = WatchCell(job->watch, target * job->portCount + (port - job->portStart), &shift);
+    unsigned char value = state == CPSCAN_PORT_OPEN ? cellOpen : (state == CPSCAN_PORT_CLOSED ? cellClosed : cellSilent);
+    unsigned char last = __atomic_load_n(cell, __ATOMIC_RELAXED) >> shift & 3;
+    if(last != value) {                                                             // Other threads only touch the other ports' bits.
+        __atomic_fetch_and(cell, (unsigned char)~(3 << shift), __ATOMIC_RELAXED);
+        __atomic_fetch_or(cell, (unsigned char)(value << shift), __ATOMIC_RELAXED);
+    }
+
+    if(job->watchCycle == 0) return CPSCAN_CHANGE_NONE;
+    CPSCAN_CHANGE change = CPSCAN_CHANGE_NONE;
+    if(value == cellOpen && last != cellOpen) change = CPSCAN_CHANGE_OPENED;
+    else if(value != cellOpen && last == cellOpen) change = CPSCAN_CHANGE_CLOSED;
+    if(change != CPSCAN_CHANGE_NONE) __atomic_store_n(&job->watch->lastChange[target], job->watchCycle, __ATOMIC_RELAXED);
+    return change;
+}
+
+/*
+Function tells whether a probe can be skipped because its result already stands: a resumed scan has it in the
+-state file, or a watch cycle leaves the port for a later one.
+Params:
+    PCPSCAN_JOB job         -       [The scan.]
+    size_t index            -       [The probe index.]
+Returns bool.
+*/
+static bool IsPortDecided(PCPSCAN_JOB job, size_t index) {
+    if(job->watch) return IsPortSettled(job, index);
+    if(!job->state) return false;
+    int shift;
+    unsigned char *cell = StateCell(job, index, &shift);
+    return (__atomic_load_n(cell, __ATOMIC_RELAXED) >> shift & 3) != cellUnknown;
+}
+
+/*
+Function stores a resolved target's address in the -state file's target table.
+Params:
+    PCPSCAN_JOB job         -       [The scan.]
+    size_t target           -       [Index of the target.]
+Returns nothing.
+*/
+static void RecordStateTarget(PCPSCAN_JOB job, size_t target) {
+    if(!job->state) return;
+    PSTATE_TARGET entry = (PSTATE_TARGET)((unsigned char*)job->state + job->state->tableOffset) + target;
+    entry->family = PackTargetAddress(&job->targets->items[target], entry->address);
+}
+
+/*
+Function maps the -state file, creating it for a new scan or checking that it belongs to the same targets,
+ports and protocol when resuming.
+Params:
+    PCPSCAN_JOB job         -       [The scan, targets and ports already set.]
+    const char *path        -       [The state file.]
+    bool resume             -       [Keep the results already in the file.]
+Returns bool (false when the file cannot be used).
+*/
+static bool OpenStateFile(PCPSCAN_JOB job, const char *path, bool resume) {
+    size_t tableOffset = sizeof(STATE_HEADER);
+    size_t bitmapOffset = (tableOffset + job->targets->count * sizeof(STATE_TARGET) + 63) & ~(size_t)63;
+    size_t bitmapSize = (job->portCount + 3) / 4;
+    size_t size = bitmapOffset + job->targets->count * bitmapSize;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (resume == true ? 0 : O_TRUNC), 0644);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) < 0) {
+        ReportNotice(job->config, CPSCAN_RED, "[Unable to open state file %s]", path);
+        if(fd >= 0) close(fd);
+        return false;
+    }
+    bool fresh = info.st_size == 0;                                                 // Resuming a missing file starts a new one.
+    if(fresh == false && (size_t)info.st_size != size) {
+        ReportNotice(job->config, CPSCAN_RED, "[State file %s belongs to a different scan]", path);
+        close(fd);
+        return false;
+    }
+    if(fresh == true && ftruncate(fd, size) < 0) {                                  // Sparse, bitmaps only take space once written.
+        ReportNotice(job->config, CPSCAN_RED, "[Unable to size state file %s]", path);
+        close(fd);
+        return false;
+    }
+
+    PSTATE_HEADER header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(header == MAP_FAILED) {
+        ReportNotice(job->config, CPSCAN_RED, "[Unable to map state file %s]", path);
+        return false;
+    }
+
+    PSTATE_TARGET table = (PSTATE_TARGET)((unsigned char*)header + tableOffset);
+    if(fresh == true) {
+        memcpy(header->magic, "CPSTATE1", 8);
+        header->headerSize = sizeof(STATE_HEADER);
+        header->entrySize = sizeof(STATE_TARGET);
+        header->targetCount = job->targets->count;
+        header->portStart = job->portStart;
+        header->portCount = job->portCount;
+        header->protocol = job->config->pt;
+        header->tableOffset = tableOffset;
+        header->bitmapOffset = bitmapOffset;
+        header->bitmapSize = bitmapSize;
+        header->created = GetWallTime();
+        for(size_t index = 0; index < job->targets->count; index++) {
+            PCPSCAN_TARGET target = &job->targets->items[index];
+            table[index].nameHash = target->name ? HashName(target->name) : 0;
+            table[index].family = PackTargetAddress(target, table[index].address);
+        }
+    }
+    else {
+        bool same = memcmp(header->magic, "CPSTATE1", 8) == 0 && header->headerSize == sizeof(STATE_HEADER) && header->entrySize == sizeof(STATE_TARGET) &&
+            header->targetCount == job->targets->count && header->portStart == job->portStart && header->portCount == job->portCount &&
+            header->protocol == (unsigned int)job->config->pt && header->tableOffset == tableOffset && header->bitmapOffset == bitmapOffset;
+        for(size_t index = 0; same == true && index < job->targets->count; index++) {     // Literal addresses must match, names by their hash.
+            PCPSCAN_TARGET target = &job->targets->items[index];
+            unsigned char address[16];
+            if(target->name) same = table[index].nameHash == HashName(target->name);
+            else same = table[index].nameHash == 0 && PackTargetAddress(target, address) == table[index].family && memcmp(address, table[index].address, 16) == 0;
+        }
+        if(same == false) {
+            ReportNotice(job->config, CPSCAN_RED, "[State file %s belongs to a different scan]", path);
+            munmap(header, size);
+            return false;
+        }
+    }
+
+    header->updated = GetWallTime();
+    header->finished = 0;
+    job->state = header;
+    job->stateSize = size;
+    return true;
+}
+
+/*
+Function writes the -state file back to disk. The mapping is shared, so results survive a crash without this,
+it only bounds what a power cut can lose.
+Params:
+    PCPSCAN_JOB job         -       [The scan.]
+    bool wait               -       [Block until the data is on disk.]
+Returns nothing.
+*/
+static void CheckpointState(PCPSCAN_JOB job, bool wait) {
+    if(!job->state) return;
+    __atomic_store_n(&job->state->updated, GetWallTime(), __ATOMIC_RELAXED);
+    msync(job->state, job->stateSize, wait == true ? MS_SYNC : MS_ASYNC);
+}
+
+/*
+Function hands the outcome of a single probe, along with what the service said if anything, to the result callback
+and prints it. The host is only named when more than one is being scanned. The binary format has no room for banners
+and leaves them out.
+Params:
+    POUTPUT_BUFFER out              -       [Where the result line is buffered.]
+    PCPSCAN_JOB job                 -       [The scan, used for the debug flag and the target list.]
+    size_t target                   -       [Index of the target that was probed.]
+    unsigned short port             -       [The port that was probed.]
+    CPSCAN_PORT_STATE state         -       [What the probe found.]
+    const unsigned char *banner     -       [Bytes the service sent, NULL for none.]
+    size_t bannerLength             -       [Bytes in the banner.]
+Returns nothing.
+*/
+static void ReportBannerResult(POUTPUT_BUFFER out, PCPSCAN_JOB job, size_t target, unsigned short port, CPSCAN_PORT_STATE state, const unsigned char *banner, size_t bannerLength) {
+    PCPSCAN_TARGET host = &job->targets->items[target];
+    if(out->metrics) CountMetric(&out->metrics->results[state], 1);
+    if(job->state) RecordPortState(job, target, port, state);
+    CPSCAN_CHANGE change = job->watch ? RecordWatchState(job, target, port, state) : CPSCAN_CHANGE_NONE;
+    if(job->watch && job->watchCycle > 0 && change == CPSCAN_CHANGE_NONE) return;      // After the baseline a watch only reports changes.
+    if(job->config->onResult) {                                                        // Embedders see every result.
+        CPSCAN_RESULT result = {target, host->name, &host->address, port, job->config->pt, state, __atomic_load_n(&host->srtt, __ATOMIC_RELAXED), banner, bannerLength, change};
+        job->config->onResult(&result, job->config->resultContext);
+    }
+    if(!out->writer || (state != CPSCAN_PORT_OPEN && change == CPSCAN_CHANGE_NONE && job->config->debug == false)) return;
+
+    if(out->writer->format == CPSCAN_FORMAT_BINARY) {                                  // Fixed size records for bulk loading.
+        RESULT_RECORD record = {0};
+        record.timestamp = GetWallTime();
+        record.family = PackTargetAddress(host, record.address);                       // Ipv4 sits in the last 4 bytes.
+        record.target = (unsigned int)target;
+        record.rtt = __atomic_load_n(&host->srtt, __ATOMIC_RELAXED);
+        record.port = port;
+        record.protocol = job->config->pt;
+        record.state = state;
+        record.change = change;
+        if(ReserveOutput(out, sizeof(record)) == false) return;
+        memcpy(out->chunk->data + out->chunk->length, &record, sizeof(record));
+        out->chunk->length += sizeof(record);
+        return;
+    }
+
+    const char *labels[] = {"OPEN", "CLOSED", "FILTERED", "OPEN|FILTERED"};
+    char address[INET6_ADDRSTRLEN];
+    char text[BANNER_SIZE * 6 + 8] = "";
+    FormatTargetAddress(host, address);
+
+    if(out->writer->format == CPSCAN_FORMAT_JSON) {                                    // One object per line.
+        const char *states[] = {"open", "closed", "filtered", "open|filtered"};
+        char name[768] = "";
+        if(host->name) EscapeJson(host->name, name, sizeof(name));
+        if(banner) EscapeBanner(banner, bannerLength, true, text, sizeof(text));
+        long long now = GetWallTime();
+        const char *changes[] = {"", ",\"change\":\"opened\"", ",\"change\":\"closed\""};
+        AppendOutput(out, "{\"ts\":%lld.%06lld,%s%s%s\"ip\":\"%s\",\"port\":%hu,\"proto\":\"%s\",\"state\":\"%s\"%s,\"rtt_us\":%d%s%s%s}\n",
+            now / 1000000, now % 1000000, host->name ? "\"host\":\"" : "", name, host->name ? "\"," : "", address, port,
+            job->config->pt == CPSCAN_UDP ? "udp" : "tcp", states[state], changes[change], __atomic_load_n(&host->srtt, __ATOMIC_RELAXED),
+            banner ? ",\"banner\":\"" : "", text, banner ? "\"" : "");
+        return;
+    }
+
+    if(banner) {                                                                       // Trails the port as [text].
+        text[0] = ' ';
+        text[1] = '[';
+        EscapeBanner(banner, bannerLength, false, text + 2, sizeof(text) - 3);
+        strcat(text, "]");
+    }
+
+    const char *label = change == CPSCAN_CHANGE_OPENED ? "OPENED" : (change == CPSCAN_CHANGE_CLOSED ? "CLOSED" : labels[state]);
+    const char *colour = clr(out->writer->colour, state == CPSCAN_PORT_OPEN ? CPSCAN_GREEN : (state == CPSCAN_PORT_OPEN_FILTERED ? CPSCAN_ORANGE : CPSCAN_RED));
+    const char *reset = CPSCAN_DEFAULT_COLOUR(out->writer->colour);
+    if(job->targets->count == 1) {
+        AppendOutput(out, "%s%s [%hu]%s%s\n", colour, label, port, text, reset);
+        return;
+    }
+
+    if(host->name) AppendOutput(out, "%s%s [%s (%s)] [%hu]%s%s\n", colour, label, host->name, address, port, text, reset);
+    else AppendOutput(out, "%s%s [%s] [%hu]%s%s\n", colour, label, address, port, text, reset);
+}
+
+/*
+Function prints the outcome of a single probe.
+Params:
+    POUTPUT_BUFFER out          -       [Where the result line is buffered.]
+    PCPSCAN_JOB job             -       [The scan, used for the debug flag and the target list.]
+    size_t target               -       [Index of the target that was probed.]
+    unsigned short port         -       [The port that was probed.]
+    CPSCAN_PORT_STATE state     -       [What the probe found.]
+Returns nothing.
+*/
+static void ReportResult(POUTPUT_BUFFER out, PCPSCAN_JOB job, size_t target, unsigned short port, CPSCAN_PORT_STATE state) {
+    ReportBannerResult(out, job, target, port, state, NULL, 0);
+}
+
+/*
+Function maps the error returned by a finished connect to a port state.
+Params:
+    int err     -       [The errno value, 0 when the connection was established.]
+Returns CPSCAN_PORT_STATE.
+*/
+static CPSCAN_PORT_STATE ClassifyConnectError(int err) {
+    if(err == 0) return CPSCAN_PORT_OPEN;
+    else if(err == ECONNREFUSED) return CPSCAN_PORT_CLOSED;
+    return CPSCAN_PORT_FILTERED;
+}
+
+/*
+Function detects a tcp simultaneous open with itself, which happens on loopback when the kernel
+picks the probed port as the ephemeral source port.
+Params:
+    int s                       -       [The connected socket.]
+    PCPSCAN_ADDRESS server      -       [The probed address and port.]
+Returns bool.
+*/
+static bool IsSelfConnected(int s, PCPSCAN_ADDRESS server) {
+    CPSCAN_ADDRESS local;
+    socklen_t len = sizeof(local);
+    memset(&local, 0, sizeof(local));
+    if(getsockname(s, &local.sa, &len) < 0 || local.sa.sa_family != server->sa.sa_family) return false;
+    if(local.sa.sa_family == AF_INET) return local.v4.sin_port == server->v4.sin_port && local.v4.sin_addr.s_addr == server->v4.sin_addr.s_addr;
+    return local.v6.sin6_port == server->v6.sin6_port && memcmp(&local.v6.sin6_addr, &server->v6.sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+/*
+Function builds the socket address for a probe.
+Params:
+    PCPSCAN_JOB job             -       [The job holding the targets.]
+    size_t target               -       [Index of the target.]
+    unsigned short port         -       [The port to probe.]
+    PCPSCAN_ADDRESS server      -       [Filled with the destination.]
+Returns socklen_t.
+*/
+static socklen_t BuildServerAddress(PCPSCAN_JOB job, size_t target, unsigned short port, PCPSCAN_ADDRESS server) {
+    *server = job->targets->items[target].address;
+    if(server->sa.sa_family == AF_INET6) {
+        server->v6.sin6_port = htons(port);                                         // Server port in network byte order.
+        return sizeof(struct sockaddr_in6);
+    }
+    server->v4.sin_port = htons(port);
+    return sizeof(struct sockaddr_in);
+}
+
+/*
+Function works out how long a probe may wait for an answer, following the host's measured round trip time
+the way tcp derives its retransmission timeout. Each retransmit doubles it.
+Params:
+    PCPSCAN_JOB job         -       [The job holding the targets.]
+    size_t target           -       [Index of the target.]
+    unsigned char attempt   -       [0 for the first try.]
+Returns long long (microseconds).
+*/
+static long long ProbeTimeout(PCPSCAN_JOB job, size_t target, unsigned char attempt) {
+    PCPSCAN_TARGET host = &job->targets->items[target];
+    int srtt = __atomic_load_n(&host->srtt, __ATOMIC_RELAXED);
+    if(srtt == 0) return (job->config->timeout * 1000LL) << attempt;               // No answers yet, fall back to -t.
+
+    long long timeout = (srtt + 4LL * __atomic_load_n(&host->rttvar, __ATOMIC_RELAXED)) << attempt;
+    if(timeout < MIN_RTT_TIMEOUT) timeout = MIN_RTT_TIMEOUT;
+    if(timeout > MAX_RTT_TIMEOUT) timeout = MAX_RTT_TIMEOUT;
+    return timeout;
+}
+
+/*
+Function folds a round trip time sample into the host's estimate (RFC 6298). Concurrent updates from
+different workers may occasionally lose a sample, which only slows convergence slightly.
+Params:
+    PCPSCAN_JOB job         -       [The job holding the targets.]
+    size_t target           -       [Index of the target.]
+    long long sample        -       [Measured round trip time in microseconds.]
+Returns nothing.
+*/
+static void RecordRttSample(PCPSCAN_JOB job, size_t target, long long sample) {
+    PCPSCAN_TARGET host = &job->targets->items[target];
+    if(sample < 1) sample = 1;
+    if(sample > MAX_RTT_TIMEOUT) sample = MAX_RTT_TIMEOUT;
+    if(job->rttHistograms) {                                                        // Bucket n holds samples of 2^n to 2^(n+1) microseconds.
+        int bucket = 63 - __builtin_clzll(sample);
+        if(bucket >= RTT_HISTOGRAM_BUCKETS) bucket = RTT_HISTOGRAM_BUCKETS - 1;
+        __atomic_fetch_add(&job->rttHistograms[target * RTT_HISTOGRAM_BUCKETS + bucket], 1, __ATOMIC_RELAXED);
+    }
+
+    long long srtt = __atomic_load_n(&host->srtt, __ATOMIC_RELAXED);
+    long long rttvar = __atomic_load_n(&host->rttvar, __ATOMIC_RELAXED);
+    if(srtt == 0) {                                                                 // First answer from this host.
+        srtt = sample;
+        rttvar = sample / 2;
+    }
+    else {
+        long long delta = sample > srtt ? sample - srtt : srtt - sample;
+        rttvar = (3 * rttvar + delta) / 4;
+        srtt = (7 * srtt + sample) / 8;
+        if(srtt < 1) srtt = 1;
+    }
+
+    __atomic_store_n(&host->rttvar, (int)rttvar, __ATOMIC_RELAXED);
+    __atomic_store_n(&host->srtt, (int)srtt, __ATOMIC_RELAXED);
+}
+
+/*
+Function hashes a destination address and port for the udp probe table.
+Params:
+    PCPSCAN_ADDRESS address     -       [The destination, port included.]
+Returns size_t.
+*/
+static size_t HashEndpoint(PCPSCAN_ADDRESS address) {
+    unsigned long long hash;
+    if(address->sa.sa_family == AF_INET) hash = (unsigned long long)address->v4.sin_addr.s_addr << 16 | address->v4.sin_port;
+    else {
+        unsigned long long words[2];
+        memcpy(words, &address->v6.sin6_addr, sizeof(words));
+        hash = words[0] ^ words[1] * 0x9e3779b97f4a7c15ULL ^ address->v6.sin6_port;
+    }
+    hash *= 0x9e3779b97f4a7c15ULL;                                                  // Fibonacci hashing, the top bits are the best mixed.
+    return (size_t)(hash >> 32 ^ hash);
+}
+
+/*
+Function compares two destinations by address and port only, ignoring flow and scope ids.
+Params:
+    PCPSCAN_ADDRESS a       -       [First destination.]
+    PCPSCAN_ADDRESS b       -       [Second destination.]
+Returns bool.
+*/
+static bool SameEndpoint(PCPSCAN_ADDRESS a, PCPSCAN_ADDRESS b) {
+    if(a->sa.sa_family != b->sa.sa_family) return false;
+    if(a->sa.sa_family == AF_INET) return a->v4.sin_port == b->v4.sin_port && a->v4.sin_addr.s_addr == b->v4.sin_addr.s_addr;
+    return a->v6.sin6_port == b->v6.sin6_port && memcmp(&a->v6.sin6_addr, &b->v6.sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+/*
+Function adds an in-flight udp probe to the hash so replies and icmp errors can find it.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t slot             -       [The probe slot.]
+Returns nothing.
+*/
+static void LinkUdpProbe(PSCAN_ENGINE engine, size_t slot) {
+    CPSCAN_ADDRESS server;
+    BuildServerAddress(engine->job, engine->probes[slot].target, engine->probes[slot].port, &server);
+    size_t bucket = HashEndpoint(&server) & engine->udp->bucketMask;
+    engine->probes[slot].next = engine->udp->buckets[bucket];
+    engine->udp->buckets[bucket] = slot;
+}
+
+/*
+Function removes a udp probe from the hash.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t slot             -       [The probe slot.]
+Returns nothing.
+*/
+static void UnlinkUdpProbe(PSCAN_ENGINE engine, size_t slot) {
+    if(!engine->udp) return;
+    CPSCAN_ADDRESS server;
+    BuildServerAddress(engine->job, engine->probes[slot].target, engine->probes[slot].port, &server);
+    size_t *link = &engine->udp->buckets[HashEndpoint(&server) & engine->udp->bucketMask];
+    while(*link != SIZE_MAX && *link != slot) link = &engine->probes[*link].next;
+    if(*link == slot) *link = engine->probes[slot].next;
+}
+
+/*
+Function finds the in-flight udp probe sent to a destination.
+Params:
+    PSCAN_ENGINE engine         -       [The engine that tracks the probes.]
+    PCPSCAN_ADDRESS address     -       [The destination, port included.]
+Returns size_t (SIZE_MAX when no probe matches).
+*/
+static size_t FindUdpProbe(PSCAN_ENGINE engine, PCPSCAN_ADDRESS address) {
+    size_t slot = engine->udp->buckets[HashEndpoint(address) & engine->udp->bucketMask];
+    while(slot != SIZE_MAX) {
+        CPSCAN_ADDRESS server;
+        BuildServerAddress(engine->job, engine->probes[slot].target, engine->probes[slot].port, &server);
+        if(SameEndpoint(&server, address) == true) return slot;
+        slot = engine->probes[slot].next;
+    }
+    return SIZE_MAX;
+}
+
+/*
+Function picks the datagram to send to a udp port.
+Params:
+    unsigned short port     -       [The destination port.]
+Returns const UDP_PAYLOAD* (NULL for an empty datagram).
+*/
+static const UDP_PAYLOAD *FindUdpPayload(unsigned short port) {
+    for(size_t index = 0; index < sizeof(udpPayloads) / sizeof(udpPayloads[0]); index++) {
+        if(udpPayloads[index].port == port) return &udpPayloads[index];
+    }
+    return NULL;
+}
+
+/*
+Function reserves the next send slot for a host, spacing probes by the host's udp gap or the -hrate cap,
+whichever is longer.
+Params:
+    PCPSCAN_TARGET host     -       [The host about to be probed.]
+    long long now           -       [The current monotonic time in microseconds.]
+    int minGap              -       [Microseconds the -hrate cap asks for, 0 when unlimited.]
+    long long *resumeAt     -       [Set to when the host may be probed again if it must wait.]
+Returns bool (false when the probe has to wait).
+*/
+static bool PaceHost(PCPSCAN_TARGET host, long long now, int minGap, long long *resumeAt) {
+    int gap = __atomic_load_n(&host->sendGap, __ATOMIC_RELAXED);
+    if(gap < minGap) gap = minGap;
+    if(gap == 0) return true;
+
+    long long next = __atomic_load_n(&host->nextSend, __ATOMIC_RELAXED);
+    while(true) {                                                                   // Workers share the host, claim the slot atomically.
+        if(next > now) {
+            *resumeAt = next;
+            return false;
+        }
+        if(__atomic_compare_exchange_n(&host->nextSend, &next, now + gap, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return true;
+    }
+}
+
+/*
+Function takes a token from a rate limit. The bucket is kept as the time the next probe is due, so taking
+a token is one compare and swap and an idle bucket never saves up more than the tolerance.
+Params:
+    PRATE_LIMIT limit       -       [The limit to charge.]
+    long long now           -       [The current monotonic time in microseconds.]
+    bool force              -       [Charge even when early, for retransmits that cannot wait.]
+    long long *resumeAt     -       [Set to when the next token is due if the probe must wait.]
+Returns bool (false when the probe has to wait).
+*/
+static bool TakeRateToken(PRATE_LIMIT limit, long long now, bool force, long long *resumeAt) {
+    if(limit->interval == 0) return true;
+    now *= 1000;                                                                    // Nanoseconds so rates above 1M/s still pace.
+
+    long long tat = __atomic_load_n(&limit->tat, __ATOMIC_RELAXED);
+    while(true) {
+        long long start = tat > now ? tat : now;
+        if(force == false && start - limit->tolerance > now) {
+            *resumeAt = (start - limit->tolerance + 999) / 1000;
+            return false;
+        }
+        if(__atomic_compare_exchange_n(&limit->tat, &tat, start + limit->interval, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return true;
+    }
+}
+
+/*
+Function checks the per host and global rate limits before a probe goes out.
+Params:
+    PCPSCAN_JOB job         -       [The job holding the limits.]
+    PCPSCAN_TARGET host     -       [The host about to be probed.]
+    long long *resumeAt     -       [Set to when the probe may go out if it must wait.]
+Returns bool (false when the probe has to wait).
+*/
+static bool PaceProbe(PCPSCAN_JOB job, PCPSCAN_TARGET host, long long *resumeAt) {
+    if(job->rate.interval == 0 && job->hostGap == 0 && job->config->pt == CPSCAN_TCP) return true; // Nothing to pace, skip the clock.
+    long long now = GetMonotonicTime();
+    return PaceHost(host, now, job->hostGap, resumeAt) == true && TakeRateToken(&job->rate, now, false, resumeAt) == true;
+}
+
+/*
+Function doubles a host's udp send gap after a probe went unanswered. Hosts that have never sent an icmp
+error are left alone, their silence is a firewall rather than an icmp rate limit.
+Params:
+    PCPSCAN_TARGET host -       [The host that dropped a probe.]
+Returns nothing.
+*/
+static void SlowHost(PCPSCAN_TARGET host) {
+    if(__atomic_load_n(&host->icmpSeen, __ATOMIC_RELAXED) == false) return;
+    int gap = __atomic_load_n(&host->sendGap, __ATOMIC_RELAXED);
+    gap = gap == 0 ? UDP_MIN_GAP : (gap > UDP_MAX_GAP / 2 ? UDP_MAX_GAP : gap * 2);
+    __atomic_store_n(&host->sendGap, gap, __ATOMIC_RELAXED);
+}
+
+/*
+Function shrinks a host's udp send gap a little after it answered, so the pace creeps back up to what it allows.
+Params:
+    PCPSCAN_TARGET host -       [The host that answered.]
+Returns nothing.
+*/
+static void EaseHost(PCPSCAN_TARGET host) {
+    int gap = __atomic_load_n(&host->sendGap, __ATOMIC_RELAXED);
+    if(gap == 0) return;
+    gap -= gap / 16 + 1;
+    __atomic_store_n(&host->sendGap, gap < UDP_MIN_GAP ? 0 : gap, __ATOMIC_RELAXED);
+}
+
+/*
+Function opens the worker's udp sockets and the in-flight probe hash.
+Params:
+    PSCAN_ENGINE engine         -       [The engine scanning udp.]
+Returns bool.
+*/
+static bool InitUdpState(PSCAN_ENGINE engine) {
+    PUDP_STATE udp = calloc(1, sizeof(UDP_STATE));
+    engine->udp = udp;
+    if(!udp) return false;
+
+    size_t size = 64;
+    while(size < engine->window * 2) size *= 2;
+    udp->buckets = malloc(size * sizeof(size_t));
+    udp->bucketMask = size - 1;
+    if(!udp->buckets) return false;
+    memset(udp->buckets, 0xff, size * sizeof(size_t));                                 // Every bucket starts out as SIZE_MAX.
+
+    int on = 1;
+    int buffer = 4 * 1024 * 1024;
+    for(int family = 0; family < 2; family++) {
+        int s = socket(family == 0 ? AF_INET : AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+        udp->sockets[family] = s;
+        if(s < 0) continue;
+        if(family == 0) setsockopt(s, SOL_IP, IP_RECVERR, &on, sizeof(on));            // Queue icmp errors, even on an unconnected socket.
+        else setsockopt(s, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on));
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+        CPSCAN_ADDRESS local = {0};                                                 // Bind now so we know our own port.
+        socklen_t len = family == 0 ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        local.sa.sa_family = family == 0 ? AF_INET : AF_INET6;
+        if(bind(s, &local.sa, len) == 0 && getsockname(s, &local.sa, &len) == 0) udp->localPorts[family] = family == 0 ? local.v4.sin_port : local.v6.sin6_port;
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;                                                        // Error queue entries raise EPOLLERR on their own.
+        ev.data.u64 = UDP_EVENT;
+        epoll_ctl(engine->epfd, EPOLL_CTL_ADD, s, &ev);
+    }
+    if(udp->sockets[0] < 0 && udp->sockets[1] < 0) {
+        ReportOutputNotice(&engine->output, engine->config, CPSCAN_RED, "[Unable to open a udp socket]");
+        return false;
+    }
+
+    for(size_t index = 0; index < UDP_BATCH_SIZE; index++) {
+        udp->sendMsgs[index].msg_hdr.msg_name = &udp->destinations[index];
+        udp->sendMsgs[index].msg_hdr.msg_iov = &udp->sendIov[index];
+        udp->sendMsgs[index].msg_hdr.msg_iovlen = 1;
+        udp->recvIov[index].iov_base = udp->buffers[index];
+        udp->recvIov[index].iov_len = UDP_RECEIVE_SIZE;
+        udp->recvMsgs[index].msg_hdr.msg_iov = &udp->recvIov[index];
+        udp->recvMsgs[index].msg_hdr.msg_iovlen = 1;
+        udp->recvMsgs[index].msg_hdr.msg_name = &udp->sources[index];
+    }
+    return true;
+}
+
+/*
+Function sets up the epoll instance and the probe pool used by the scan engine.
+Params:
+    PSCAN_ENGINE engine         -       [The engine to initialise.]
+    PCPSCAN_JOB job             -       [The job to pull ports from.]
+    size_t window               -       [Maximum number of connects in flight.]
+    PCPSCAN_METRICS metrics     -       [The worker's counters.]
+Returns bool.
+*/
+static bool InitScanEngine(PSCAN_ENGINE engine, PCPSCAN_JOB job, size_t window, PCPSCAN_METRICS metrics) {
+    memset(engine, 0, sizeof(SCAN_ENGINE));
+    engine->job = job;
+    engine->config = job->config;
+    engine->output.writer = job->writer;
+    engine->output.metrics = metrics;
+    engine->metrics = metrics;
+    engine->window = window;
+    engine->limit = window;
+
+    engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+    engine->probes = calloc(window, sizeof(PROBE));
+    engine->freeSlots = calloc(window, sizeof(size_t));
+    engine->heap = calloc(window, sizeof(size_t));
+    if(engine->epfd < 0 || !engine->probes || !engine->freeSlots || !engine->heap) {
+        ReportNotice(job->config, CPSCAN_RED, "[Unable to initialise the scan engine]");
+        return false;
+    }
+
+    for(size_t index = 0; index < window; index++) {                                // Every slot starts out free.
+        engine->probes[index].fd = -1;
+        engine->freeSlots[engine->freeCount++] = window - index - 1;
+    }
+
+    struct epoll_event ev = {0};                                                    // Edge triggered so every resolution wakes every worker
+    ev.events = EPOLLIN | EPOLLET;                                                  // without anyone having to drain the counter.
+    ev.data.u64 = RESOLVER_EVENT;
+    epoll_ctl(engine->epfd, EPOLL_CTL_ADD, job->wakeEvent, &ev);
+    return job->config->pt == CPSCAN_UDP ? InitUdpState(engine) : true;
+}
+
+/*
+Function releases everything held by the scan engine.
+Params:
+    PSCAN_ENGINE engine     -       [The engine to tear down.]
+Returns nothing.
+*/
+static void FreeScanEngine(PSCAN_ENGINE engine) {
+    FlushOutput(&engine->output);
+    for(size_t index = 0; index < engine->heapSize; index++) {
+        if(engine->probes[engine->heap[index]].fd >= 0) close(engine->probes[engine->heap[index]].fd);
+    }
+    if(engine->udp) {
+        if(engine->udp->sockets[0] >= 0) close(engine->udp->sockets[0]);
+        if(engine->udp->sockets[1] >= 0) close(engine->udp->sockets[1]);
+        free(engine->udp->buckets);
+        free(engine->udp);
+    }
+    if(engine->banners) {
+        for(size_t index = 0; engine->banners->reads && index < engine->banners->window; index++) {
+            if(engine->banners->reads[index].fd >= 0) close(engine->banners->reads[index].fd);
+        }
+        free(engine->banners->reads);
+        free(engine->banners->freeSlots);
+        free(engine->banners);
+    }
+    if(engine->epfd >= 0) close(engine->epfd);
+    free(engine->probes);
+    free(engine->freeSlots);
+    free(engine->heap);
+}
+
+/*
+Function closes a connected socket with a reset instead of a fin, so it never sits in TIME_WAIT holding a source port.
+Params:
+    int s       -       [The connected socket.]
+Returns nothing.
+*/
+static void ResetSocket(int s) {
+    struct linger abortive = {1, 0};
+    setsockopt(s, SOL_SOCKET, SO_LINGER, &abortive, sizeof(abortive));
+    close(s);
+}
+
+/*
+Function picks the request to send to an open tcp port.
+Params:
+    unsigned short port     -       [The destination port.]
+Returns const TCP_PROBE* (NULL to wait for the service to speak first).
+*/
+static const TCP_PROBE *FindTcpProbe(unsigned short port) {
+    for(size_t index = 0; index < sizeof(tcpProbes) / sizeof(tcpProbes[0]); index++) {
+        if(tcpProbes[index].port == port) return &tcpProbes[index];
+    }
+    return NULL;
+}
+
+/*
+Function sets up the banner read pool of an engine.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that hands over its open ports.]
+    size_t window           -       [Maximum number of banner reads in flight.]
+Returns bool.
+*/
+static bool InitBannerStage(PSCAN_ENGINE engine, size_t window) {
+    PBANNER_STAGE stage = calloc(1, sizeof(BANNER_STAGE));
+    if(!stage) return false;
+    engine->banners = stage;
+    stage->reads = calloc(window, sizeof(BANNER_READ));
+    stage->freeSlots = calloc(window, sizeof(size_t));
+    if(!stage->reads || !stage->freeSlots) {
+        ReportOutputNotice(&engine->output, engine->config, CPSCAN_RED, "[Unable to initialise the banner reads]");
+        return false;
+    }
+
+    stage->window = window;
+    stage->head = SIZE_MAX;
+    stage->tail = SIZE_MAX;
+    for(size_t index = 0; index < window; index++) {
+        stage->reads[index].fd = -1;
+        stage->freeSlots[stage->freeCount++] = window - index - 1;
+    }
+    return true;
+}
+
+/*
+Function appends a banner read to the end of the deadline list.
+Params:
+    PBANNER_STAGE stage     -       [The engine's banner reads.]
+    size_t slot             -       [The read slot.]
+Returns nothing.
+*/
+static void LinkBannerRead(PBANNER_STAGE stage, size_t slot) {
+    stage->reads[slot].prev = stage->tail;
+    stage->reads[slot].next = SIZE_MAX;
+    if(stage->tail != SIZE_MAX) stage->reads[stage->tail].next = slot;
+    else stage->head = slot;
+    stage->tail = slot;
+}
+
+/*
+Function takes a banner read out of the deadline list.
+Params:
+    PBANNER_STAGE stage     -       [The engine's banner reads.]
+    size_t slot             -       [The read slot.]
+Returns nothing.
+*/
+static void UnlinkBannerRead(PBANNER_STAGE stage, size_t slot) {
+    PBANNER_READ read = &stage->reads[slot];
+    if(read->prev != SIZE_MAX) stage->reads[read->prev].next = read->next;
+    else stage->head = read->next;
+    if(read->next != SIZE_MAX) stage->reads[read->next].prev = read->prev;
+    else stage->tail = read->prev;
+}
+
+/*
+Function hands a freshly connected socket to the banner stage instead of closing it. Services that wait for
+the client get their request straight away, the rest get BANNER_WAIT to greet us first.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that found the port open.]
+    int s                   -       [The connected socket, watched by the engine's epoll or not yet.]
+    size_t target           -       [Index of the target.]
+    unsigned short port     -       [The open port.]
+Returns bool (false when every read slot is busy and the caller should close the socket itself).
+*/
+static bool StartBannerRead(PSCAN_ENGINE engine, int s, size_t target, unsigned short port) {
+    PBANNER_STAGE stage = engine->banners;
+    if(stage->freeCount == 0) return false;
+
+    size_t slot = stage->freeSlots[--stage->freeCount];
+    PBANNER_READ read = &stage->reads[slot];
+    const TCP_PROBE *probe = FindTcpProbe(port);
+    read->fd = s;
+    read->target = target;
+    read->port = port;
+    read->probed = probe != NULL;
+    read->deadline = GetMonotonicTime() + BANNER_WAIT;
+    if(probe && send(s, probe->data, probe->length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) CountError(engine->metrics, errno);
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP;                                               // Readable once the service speaks or hangs up.
+    ev.data.u64 = BANNER_EVENT | slot;
+    if(epoll_ctl(engine->epfd, EPOLL_CTL_MOD, s, &ev) < 0) epoll_ctl(engine->epfd, EPOLL_CTL_ADD, s, &ev);
+    LinkBannerRead(stage, slot);
+    return true;
+}
+
+/*
+Function ends a banner read, resets the connection and reports the port open with whatever arrived.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that owns the read.]
+    size_t slot             -       [The read slot.]
+    size_t length           -       [Bytes of banner in the stage's buffer, 0 for none.]
+Returns nothing.
+*/
+static void FinishBannerRead(PSCAN_ENGINE engine, size_t slot, size_t length) {
+    PBANNER_STAGE stage = engine->banners;
+    PBANNER_READ read = &stage->reads[slot];
+    UnlinkBannerRead(stage, slot);
+    ResetSocket(read->fd);
+    read->fd = -1;
+    stage->freeSlots[stage->freeCount++] = slot;
+    if(length > 0) CountMetric(&engine->metrics->banners, 1);
+    ReportBannerResult(&engine->output, engine->job, read->target, read->port, CPSCAN_PORT_OPEN, length > 0 ? stage->buffer : NULL, length);
+}
+
+/*
+Function reads whatever a service sent. The first segment is enough to name most services, so the read ends there.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that owns the read.]
+    size_t slot             -       [The read slot.]
+Returns nothing.
+*/
+static void ReadBanner(PSCAN_ENGINE engine, size_t slot) {
+    ssize_t length = recv(engine->banners->reads[slot].fd, engine->banners->buffer, BANNER_SIZE, MSG_DONTWAIT);
+    if(length < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if(length < 0 && errno != ECONNRESET) CountError(engine->metrics, errno);
+    FinishBannerRead(engine, slot, length > 0 ? (size_t)length : 0);
+}
+
+/*
+Function deals with banner reads whose wait ran out: a quiet service that was never asked anything gets the
+generic probe and another BANNER_WAIT, the rest are reported without a banner.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that owns the reads.]
+    long long now           -       [The current monotonic time in microseconds.]
+Returns nothing.
+*/
+static void ExpireBannerReads(PSCAN_ENGINE engine, long long now) {
+    PBANNER_STAGE stage = engine->banners;
+    while(stage->head != SIZE_MAX && stage->reads[stage->head].deadline <= now) {
+        size_t slot = stage->head;
+        PBANNER_READ read = &stage->reads[slot];
+        if(read->probed == true) {
+            FinishBannerRead(engine, slot, 0);
+            continue;
+        }
+
+        read->probed = true;
+        if(send(read->fd, genericProbe.data, genericProbe.length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if(errno != ECONNRESET && errno != EPIPE) CountError(engine->metrics, errno);
+            FinishBannerRead(engine, slot, 0);
+            continue;
+        }
+        read->deadline = now + BANNER_WAIT;
+        UnlinkBannerRead(stage, slot);                                              // Goes to the back, the wait is as long as everyone else's.
+        LinkBannerRead(stage, slot);
+    }
+}
+
+/*
+Function parks a retransmit in the heap without a socket until it may be sent, RetryProbe sends it then.
+Params:
+    PSCAN_ENGINE engine     -       [The engine whose slot the retransmit just released.]
+    size_t target           -       [Index of the resolved target.]
+    unsigned short port     -       [The port to probe again.]
+    unsigned char attempt   -       [Counts retransmits.]
+    long long until         -       [Monotonic time in microseconds when it may go out.]
+Returns nothing.
+*/
+static void ParkProbe(PSCAN_ENGINE engine, size_t target, unsigned short port, unsigned char attempt, long long until) {
+    size_t slot = engine->freeSlots[--engine->freeCount];
+    PPROBE probe = &engine->probes[slot];
+    probe->fd = -1;
+    probe->target = target;
+    probe->port = port;
+    probe->attempt = attempt;
+    probe->sent = 0;
+    probe->deadline = until;
+    probe->heapIndex = engine->heapSize;
+    engine->heap[engine->heapSize++] = slot;
+    HeapSiftUp(engine, probe->heapIndex);
+}
+
+/*
+Function shrinks the engine's window after a launch ran out of descriptors or source ports and arms a
+growing wait before the next launch. A retransmit is parked in the heap without a socket so it is not lost.
+With nothing of ours in flight to free one up, ports are given up once the stall has lasted MAX_RESOURCE_STALL.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that failed to launch.]
+    size_t target           -       [Index of the resolved target.]
+    unsigned short port     -       [The port that could not be probed.]
+    unsigned char attempt   -       [0 for the first try, counts retransmits.]
+Returns bool (false when the caller should retry the port itself, true once it is parked or given up).
+*/
+static bool BackOffProbe(PSCAN_ENGINE engine, size_t target, unsigned short port, unsigned char attempt) {
+    long long now = GetMonotonicTime();
+    engine->limit = engine->heapSize > 1 ? engine->heapSize / 2 : 1;                 // What is in flight now is roughly what fits.
+    engine->backoff = engine->backoff == 0 ? MIN_RESOURCE_BACKOFF : engine->backoff * 2;
+    if(engine->backoff > MAX_RESOURCE_BACKOFF) engine->backoff = MAX_RESOURCE_BACKOFF;
+    engine->resumeAt = now + engine->backoff;
+
+    if(engine->heapSize == 0 && engine->stalledSince == 0) engine->stalledSince = now;
+    if(engine->heapSize == 0 && now - engine->stalledSince >= MAX_RESOURCE_STALL) {    // Nothing of ours will free one up, give the port up.
+        if(engine->socketReported == false) ReportOutputNotice(&engine->output, engine->config, CPSCAN_RED, "INVALID SOCKET");
+        engine->socketReported = true;
+        ReportResult(&engine->output, engine->job, target, port, CPSCAN_PORT_FILTERED);
+        engine->resumeAt = 0;                                                         // Until a socket comes through, later ports give up at once.
+        return true;
+    }
+    if(attempt == 0) return false;
+    ParkProbe(engine, target, port, attempt, engine->resumeAt);                       // The retransmit's old slot was just released.
+    return true;
+}
+
+/*
+Function starts a non blocking connect to a port and registers it with the engine.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t target           -       [Index of the resolved target.]
+    unsigned short port     -       [The port to probe.]
+    unsigned char attempt   -       [0 for the first try, counts retransmits.]
+Returns bool (false when no descriptor or source port is available and the port should be retried later).
+*/
+static bool LaunchProbe(PSCAN_ENGINE engine, size_t target, unsigned short port, unsigned char attempt) {
+    if(engine->config->pt == CPSCAN_UDP) return LaunchUdpProbe(engine, target, port); // Datagrams share the worker's sockets.
+
+    CPSCAN_ADDRESS server;
+    socklen_t serverLength = BuildServerAddress(engine->job, target, port, &server);
+    int s = socket(server.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);   // Create the socket already in non blocking mode.
+    if(s < 0) CountError(engine->metrics, errno);
+    if(s < 0 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) return BackOffProbe(engine, target, port, attempt);
+    if(s < 0) {                                                                     // No such family here, e.g. ipv6 on a host without it.
+        if(engine->socketReported == false) ReportOutputNotice(&engine->output, engine->config, CPSCAN_RED, "INVALID SOCKET");
+        engine->socketReported = true;
+        ReportResult(&engine->output, engine->job, target, port, CPSCAN_PORT_FILTERED);
+        return true;
+    }
+    long long stalledSince = engine->stalledSince;
+    engine->stalledSince = 0;                                                       // Descriptors are back, the stall is over.
+
+    long long sent = GetMonotonicTime();
+    int err = connect(s, &server.sa, serverLength);
+    if(err < 0 && errno != EINPROGRESS && errno != ECONNREFUSED) CountError(engine->metrics, errno);
+    if(err < 0 && errno == EADDRNOTAVAIL) {                                          // Every ephemeral source port to this host is taken.
+        close(s);
+        engine->stalledSince = stalledSince;                                        // Still stalled, on source ports now.
+        return BackOffProbe(engine, target, port, attempt);
+    }
+    engine->backoff = 0;
+    CountMetric(&engine->metrics->sent, 1);
+
+    if(err == 0 || errno != EINPROGRESS) {                                           // Finished straight away, usually on loopback.
+        CPSCAN_PORT_STATE state = ClassifyConnectError(err == 0 ? 0 : errno);
+        if(state != CPSCAN_PORT_FILTERED) RecordRttSample(engine->job, target, GetMonotonicTime() - sent);
+        if(state == CPSCAN_PORT_OPEN && IsSelfConnected(s, &server) == true) state = CPSCAN_PORT_CLOSED;
+        if(state == CPSCAN_PORT_OPEN && engine->banners && StartBannerRead(engine, s, target, port) == true) return true;
+        if(err == 0) ResetSocket(s);
+        else close(s);
+        ReportResult(&engine->output, engine->job, target, port, state);
+        return true;
+    }
+
+    size_t slot = engine->freeSlots[--engine->freeCount];
+    PPROBE probe = &engine->probes[slot];
+    probe->fd = s;
+    probe->target = target;
+    probe->port = port;
+    probe->attempt = attempt;
+    probe->sent = sent;
+    probe->deadline = sent + ProbeTimeout(engine->job, target, attempt);
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLOUT;                                                           // Writable once the handshake finishes or fails.
+    ev.data.u64 = slot;
+    epoll_ctl(engine->epfd, EPOLL_CTL_ADD, s, &ev);
+
+    probe->heapIndex = engine->heapSize;
+    engine->heap[engine->heapSize++] = slot;
+    HeapSiftUp(engine, probe->heapIndex);
+    return true;
+}
+
+/*
+Function takes a probe out of the heap, drops its socket or hash entry and returns its slot to the pool.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t slot             -       [The probe slot.]
+Returns nothing.
+*/
+static void ReleaseProbe(PSCAN_ENGINE engine, size_t slot) {
+    PPROBE probe = &engine->probes[slot];
+    HeapRemove(engine, probe->heapIndex);
+    if(probe->fd >= 0) close(probe->fd);                                            // Closing also drops it from the epoll set.
+    else if(engine->udp) UnlinkUdpProbe(engine, slot);
+    probe->fd = -1;
+    engine->freeSlots[engine->freeCount++] = slot;
+}
+
+/*
+Function finishes a probe, reports it and returns its slot to the pool.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t slot             -       [The probe slot.]
+    CPSCAN_PORT_STATE state -       [What the probe found.]
+Returns nothing.
+*/
+static void CompleteProbe(PSCAN_ENGINE engine, size_t slot, CPSCAN_PORT_STATE state) {
+    PPROBE probe = &engine->probes[slot];
+    bool answered = state == CPSCAN_PORT_OPEN || state == CPSCAN_PORT_CLOSED;
+    if(answered == true && probe->attempt == 0) RecordRttSample(engine->job, probe->target, GetMonotonicTime() - probe->sent);  // Karn: skip retransmits.
+    if(answered == true && engine->udp) EaseHost(&engine->job->targets->items[probe->target]);
+    if(engine->limit < engine->window) engine->limit++;                             // Win back the window one completion at a time.
+    if(state == CPSCAN_PORT_OPEN && probe->fd >= 0) {
+        CPSCAN_ADDRESS server;
+        BuildServerAddress(engine->job, probe->target, probe->port, &server);
+        if(IsSelfConnected(probe->fd, &server) == true) state = CPSCAN_PORT_CLOSED;
+        if(state == CPSCAN_PORT_OPEN && engine->banners && StartBannerRead(engine, probe->fd, probe->target, probe->port) == true) {
+            probe->fd = -1;                                                         // The banner read owns the socket now.
+            ReleaseProbe(engine, slot);
+            return;
+        }
+        ResetSocket(probe->fd);                                                     // ReleaseProbe would close it with a fin.
+        probe->fd = -1;
+    }
+    ReleaseProbe(engine, slot);
+    ReportResult(&engine->output, engine->job, probe->target, probe->port, state);
+}
+
+/*
+Function abandons a probe that timed out and sends it again with a longer timeout, or sends a parked
+retransmit once its back off is over. Like first attempts, retransmits wait for the host's -hrate slot.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t slot             -       [The probe slot.]
+Returns nothing.
+*/
+static void RetryProbe(PSCAN_ENGINE engine, size_t slot) {
+    PPROBE probe = &engine->probes[slot];
+    bool parked = probe->fd < 0;
+    size_t target = probe->target;
+    unsigned short port = probe->port;
+    unsigned char attempt = parked == true ? probe->attempt : probe->attempt + 1;
+
+    ReleaseProbe(engine, slot);
+    long long now = GetMonotonicTime();
+    long long resumeAt;
+    if(parked == false) {
+        TakeRateToken(&engine->job->rate, now, true, &resumeAt);                    // Retransmits count against -rate but never wait on it.
+        CountMetric(&engine->metrics->timeouts, 1);
+        CountMetric(&engine->metrics->retries, 1);
+    }
+    if(PaceHost(&engine->job->targets->items[target], now, engine->job->hostGap, &resumeAt) == false) ParkProbe(engine, target, port, attempt, resumeAt);
+    else LaunchProbe(engine, target, port, attempt);
+}
+
+/*
+Function writes the queued udp datagrams with as few sendmmsg calls as possible.
+Params:
+    PSCAN_ENGINE engine     -       [The engine holding the batch.]
+Returns nothing.
+*/
+static void FlushUdpBatch(PSCAN_ENGINE engine) {
+    PUDP_STATE udp = engine->udp;
+    unsigned int sent = 0;
+    while(sent < udp->sendCount) {
+        int result = sendmmsg(udp->sendSocket, udp->sendMsgs + sent, udp->sendCount - sent, 0);
+        if(result > 0) sent += result;
+        else if(errno == EAGAIN || errno == ENOBUFS) {
+            struct pollfd pfd = {udp->sendSocket, POLLOUT, 0};                       // Socket buffer is full, let it drain.
+            poll(&pfd, 1, 1);
+        }
+        else if(errno == EINTR || errno == ECONNREFUSED) continue;                   // A pending icmp error surfaced here, it is queued too.
+        else {
+            CountError(engine->metrics, errno);
+            CompleteProbe(engine, udp->sendSlots[sent++], CPSCAN_PORT_FILTERED);    // Unreachable network or similar, nothing will come back.
+        }
+    }
+    udp->sendCount = 0;
+}
+
+/*
+Function queues a datagram for a udp probe and arms its deadline.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t slot             -       [The probe slot.]
+    long long now           -       [The current monotonic time in microseconds.]
+Returns nothing.
+*/
+static void QueueUdpProbe(PSCAN_ENGINE engine, size_t slot, long long now) {
+    PUDP_STATE udp = engine->udp;
+    PPROBE probe = &engine->probes[slot];
+    CPSCAN_ADDRESS server;
+    socklen_t serverLength = BuildServerAddress(engine->job, probe->target, probe->port, &server);
+    int s = udp->sockets[server.sa.sa_family == AF_INET ? 0 : 1];
+    if(udp->sendCount == UDP_BATCH_SIZE || (udp->sendCount > 0 && udp->sendSocket != s)) FlushUdpBatch(engine);
+
+    const UDP_PAYLOAD *payload = FindUdpPayload(probe->port);
+    unsigned int index = udp->sendCount++;
+    udp->sendSocket = s;
+    udp->sendSlots[index] = slot;
+    udp->destinations[index] = server;
+    udp->sendIov[index].iov_base = payload ? (void*)payload->data : NULL;
+    udp->sendIov[index].iov_len = payload ? payload->length : 0;
+    udp->sendMsgs[index].msg_hdr.msg_namelen = serverLength;
+
+    probe->sent = now;
+    probe->sendGap = __atomic_load_n(&engine->job->targets->items[probe->target].sendGap, __ATOMIC_RELAXED);
+    CountMetric(&engine->metrics->sent, 1);
+    probe->deadline = now + ProbeTimeout(engine->job, probe->target, probe->attempt);
+}
+
+/*
+Function starts a udp probe, the caller has already paced it.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t target           -       [Index of the resolved target.]
+    unsigned short port     -       [The port to probe.]
+Returns bool.
+*/
+static bool LaunchUdpProbe(PSCAN_ENGINE engine, size_t target, unsigned short port) {
+    PCPSCAN_TARGET host = &engine->job->targets->items[target];
+    int family = host->address.sa.sa_family == AF_INET ? 0 : 1;
+    if(engine->udp->sockets[family] < 0) {                                          // No ipv6 on this machine.
+        ReportResult(&engine->output, engine->job, target, port, CPSCAN_PORT_FILTERED);
+        return true;
+    }
+
+    long long now = GetMonotonicTime();
+    size_t slot = engine->freeSlots[--engine->freeCount];
+    PPROBE probe = &engine->probes[slot];
+    probe->fd = -1;
+    probe->target = target;
+    probe->port = port;
+    probe->attempt = 0;
+    QueueUdpProbe(engine, slot, now);
+    LinkUdpProbe(engine, slot);
+
+    probe->heapIndex = engine->heapSize;
+    engine->heap[engine->heapSize++] = slot;
+    HeapSiftUp(engine, probe->heapIndex);
+    return true;
+}
+
+/*
+Function handles a udp probe whose deadline passed: the datagram or its answer was lost, or a held back
+resend may now go out. Silence after the last attempt means open or filtered. A loss while the host was
+already being slowed down is blamed on its icmp rate limit and does not use up an attempt.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probe.]
+    size_t slot             -       [The probe slot.]
+    long long now           -       [The current monotonic time in microseconds.]
+Returns nothing.
+*/
+static void ExpireUdpProbe(PSCAN_ENGINE engine, size_t slot, long long now) {
+    PPROBE probe = &engine->probes[slot];
+    PCPSCAN_TARGET host = &engine->job->targets->items[probe->target];
+    if(probe->sent != 0) {                                                          // A real timeout, not a held resend.
+        bool throttled = __atomic_load_n(&host->sendGap, __ATOMIC_RELAXED) > probe->sendGap;
+        SlowHost(host);
+        CountMetric(&engine->metrics->timeouts, 1);
+        if(throttled == false && probe->attempt >= engine->config->retries) {
+            CompleteProbe(engine, slot, CPSCAN_PORT_OPEN_FILTERED);
+            return;
+        }
+        if(throttled == false) probe->attempt++;
+        probe->sent = 0;
+    }
+
+    long long resumeAt;
+    if(PaceHost(host, now, engine->job->hostGap, &resumeAt) == false) probe->deadline = resumeAt;    // Keep the slot until the host may be probed again.
+    else {
+        TakeRateToken(&engine->job->rate, now, true, &resumeAt);                    // Resends count against -rate but never wait on it.
+        CountMetric(&engine->metrics->retries, 1);
+        QueueUdpProbe(engine, slot, now);
+    }
+    HeapSiftDown(engine, probe->heapIndex);
+}
+
+/*
+Function maps an icmp error queued on a udp socket to a port state.
+Params:
+    struct sock_extended_err *err   -       [The queued error.]
+    CPSCAN_PORT_STATE *state                -       [Set to the outcome when the error is about the port.]
+Returns bool (false for errors that say nothing about the port, like fragmentation needed).
+*/
+static bool ClassifyIcmpError(struct sock_extended_err *err, CPSCAN_PORT_STATE *state) {
+    if(err->ee_origin == SO_EE_ORIGIN_ICMP && err->ee_type == ICMP_DEST_UNREACH) {
+        if(err->ee_code == ICMP_FRAG_NEEDED) return false;
+        *state = err->ee_code == ICMP_PORT_UNREACH ? CPSCAN_PORT_CLOSED : CPSCAN_PORT_FILTERED; // Host, net and admin prohibited mean a firewall.
+        return true;
+    }
+    if(err->ee_origin == SO_EE_ORIGIN_ICMP6 && err->ee_type == ICMP6_DST_UNREACH) {
+        *state = err->ee_code == ICMP6_DST_UNREACH_NOPORT ? CPSCAN_PORT_CLOSED : CPSCAN_PORT_FILTERED;
+        return true;
+    }
+    return false;
+}
+
+/*
+Function detects a datagram the worker sent to its own socket, which happens on loopback when the probed
+port is the one the socket is bound to.
+Params:
+    PUDP_STATE udp              -       [The worker's udp state.]
+    size_t index                -       [The received message.]
+Returns bool.
+*/
+static bool IsSelfDelivered(PUDP_STATE udp, size_t index) {
+    PCPSCAN_ADDRESS source = &udp->sources[index];
+    unsigned short port = source->sa.sa_family == AF_INET ? source->v4.sin_port : source->v6.sin6_port;
+    if(port != udp->localPorts[source->sa.sa_family == AF_INET ? 0 : 1]) return false;
+
+    const UDP_PAYLOAD *payload = FindUdpPayload(ntohs(port));                      // Our own probe comes back byte for byte.
+    size_t length = payload ? payload->length : 0;
+    return udp->recvMsgs[index].msg_len == length && (length == 0 || memcmp(udp->buffers[index], payload->data, length) == 0);
+}
+
+/*
+Function drains replies and queued icmp errors from one of the worker's udp sockets in batches.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that tracks the probes.]
+    int s                   -       [The udp socket.]
+Returns nothing.
+*/
+static void DrainUdpSocket(PSCAN_ENGINE engine, int s) {
+    PUDP_STATE udp = engine->udp;
+    for(int pass = 0; pass < 2; pass++) {                                           // Replies first, then the error queue.
+        int flags = MSG_DONTWAIT | (pass == 1 ? MSG_ERRQUEUE : 0);
+        int failures = 0;
+        while(true) {
+            for(size_t index = 0; index < UDP_BATCH_SIZE; index++) {
+                udp->recvMsgs[index].msg_hdr.msg_namelen = sizeof(CPSCAN_ADDRESS);
+                udp->recvMsgs[index].msg_hdr.msg_control = pass == 1 ? udp->control[index] : NULL;
+                udp->recvMsgs[index].msg_hdr.msg_controllen = pass == 1 ? UDP_CONTROL_SIZE : 0;
+            }
+
+            int count = recvmmsg(s, udp->recvMsgs, UDP_BATCH_SIZE, flags, NULL);
+            if(count <= 0) {
+                if(errno == EAGAIN || ++failures > 4) break;                         // Pending icmp errors are also reported here once.
+                continue;
+            }
+
+            for(int index = 0; index < count; index++) {
+                CPSCAN_PORT_STATE state = CPSCAN_PORT_OPEN;                          // Any datagram back from the port means open.
+                struct msghdr *msg = &udp->recvMsgs[index].msg_hdr;
+                if(pass == 1) {
+                    bool known = false;
+                    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+                        if((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                            known = ClassifyIcmpError((struct sock_extended_err*)CMSG_DATA(cmsg), &state);
+                        }
+                    }
+                    if(known == false) continue;
+                }
+                else if(IsSelfDelivered(udp, index) == true) state = CPSCAN_PORT_CLOSED;
+
+                size_t slot = FindUdpProbe(engine, &udp->sources[index]);           // The error queue hands back the original destination.
+                if(slot == SIZE_MAX) continue;
+                if(pass == 1) __atomic_store_n(&engine->job->targets->items[engine->probes[slot].target].icmpSeen, true, __ATOMIC_RELAXED);
+                CompleteProbe(engine, slot, state);
+            }
+        }
+    }
+}
+
+/*
+Function scrambles a 64 bit value with the splitmix64 finaliser.
+Params:
+    unsigned long long x        -       [The value.]
+Returns unsigned long long.
+*/
+static unsigned long long MixBits(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/*
+Function picks random keys and the smallest bit width whose square covers every probe index, for -randomize.
+Params:
+    PCPSCAN_JOB job     -       [The job, totalProbes already set.]
+Returns nothing.
+*/
+static void InitPermutation(PCPSCAN_JOB job) {
+    job->permutationBits = 1;
+    while(job->permutationBits < 32 && 1ULL << (2 * job->permutationBits) < job->totalProbes) job->permutationBits++;
+    if(getrandom(job->permutationKeys, sizeof(job->permutationKeys), 0) != sizeof(job->permutationKeys)) {
+        for(int round = 0; round < PERMUTATION_ROUNDS; round++) job->permutationKeys[round] = MixBits(GetMonotonicTime() + round);
+    }
+}
+
+/*
+Function maps a position in the scan to the probe index sent at that position. With -randomize this is a
+keyed Feistel network over the smallest power of four that covers the index space, and results that land
+outside it are fed through again (cycle walking). That keeps it a permutation of exactly the real indexes
+with no memory per probe, and the walk is short since at most three quarters of the space is outside.
+Params:
+    PCPSCAN_JOB job         -       [The job.]
+    size_t position         -       [How many probes come before this one.]
+Returns size_t (the probe index, target times ports plus port offset).
+*/
+static size_t PermuteProbe(PCPSCAN_JOB job, size_t position) {
+    if(job->permutationBits == 0) return position;
+    unsigned long long mask = (1ULL << job->permutationBits) - 1;
+    unsigned long long value = position;
+    do {
+        unsigned long long left = value >> job->permutationBits;
+        unsigned long long right = value & mask;
+        for(int round = 0; round < PERMUTATION_ROUNDS; round++) {
+            unsigned long long next = left ^ (MixBits(right ^ job->permutationKeys[round]) & mask);
+            left = right;
+            right = next;
+        }
+        value = left << job->permutationBits | right;
+    } while(value >= job->totalProbes);
+    return (size_t)value;
+}
+
+/*
+Function makes sure the engine has a block of ports to launch, claiming a new one from the job if needed.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that needs work.]
+Returns bool (false once every block has been handed out).
+*/
+static bool ClaimPortBlock(PSCAN_ENGINE engine) {
+    if(engine->chunkNext < engine->chunkEnd) return true;
+    if(engine->exhausted == true) return false;
+
+    size_t begin = __atomic_fetch_add(&engine->job->nextIndex, PORT_BLOCK_SIZE, __ATOMIC_RELAXED);   // Lock free hand out of the next block.
+    if(begin >= engine->job->totalProbes) {
+        engine->exhausted = true;
+        return false;
+    }
+
+    engine->chunkNext = begin;
+    engine->chunkEnd = begin + PORT_BLOCK_SIZE < engine->job->totalProbes ? begin + PORT_BLOCK_SIZE : engine->job->totalProbes;
+    return true;
+}
+
+/*
+Function works out how long the engine may sleep before it has to run again.
+Params:
+    PSCAN_ENGINE engine     -       [The engine that is about to wait.]
+Returns int (milliseconds, -1 when only an event on its epoll instance can give it work).
+*/
+static int EngineWaitTime(PSCAN_ENGINE engine) {
+    PBANNER_STAGE banners = engine->banners;
+    bool room = engine->freeCount > 0 && engine->heapSize < engine->limit && (!banners || banners->freeCount > 0);
+    if(room == true && engine->waiting == false && engine->resumeAt == 0 && (engine->chunkNext < engine->chunkEnd || engine->exhausted == false)) return 0;   // More ports are ready to go.
+
+    long long wake = engine->resumeAt;                                              // The rate limits let the next probe go.
+    if(engine->heapSize > 0 && (wake == 0 || engine->probes[engine->heap[0]].deadline < wake)) wake = engine->probes[engine->heap[0]].deadline;
+    if(banners && banners->head != SIZE_MAX && (wake == 0 || banners->reads[banners->head].deadline < wake)) wake = banners->reads[banners->head].deadline;
+    if(wake == 0) return -1;                                                        // Only a resolver event can wake us.
+    long long wait = wake - GetMonotonicTime();                                     // Sleep until the earliest deadline.
+    return wait <= 0 ? 0 : (int)((wait + 999) / 1000);
+}
+
+/*
+Function runs one round of the event loop: fills the window, waits for events and expires stale probes.
+Params:
+    PSCAN_ENGINE engine     -       [The engine to drive.]
+    bool block              -       [Sleep until there is something to do, otherwise only take the events already waiting.]
+Returns bool (true while there is still work to do).
+*/
+static bool EngineStep(PSCAN_ENGINE engine, bool block) {
+    PCPSCAN_JOB job = engine->job;
+    PBANNER_STAGE banners = engine->banners;
+    bool reading = banners && banners->head != SIZE_MAX;                            // Banner reads keep the engine alive on their own.
+    size_t launched = 0;
+    engine->waiting = false;
+    engine->resumeAt = 0;
+    while(engine->freeCount > 0 && engine->heapSize < engine->limit && launched < MAX_EPOLL_EVENTS && (!banners || banners->freeCount > 0) && ClaimPortBlock(engine) == true) {   // Keep the window full without starving the event loop or outrunning the banner reads.
+        size_t index = PermuteProbe(job, engine->chunkNext);
+        size_t target = index / job->portCount;
+        unsigned char state = __atomic_load_n(&job->targets->items[target].state, __ATOMIC_ACQUIRE);
+        if(state == CPSCAN_TARGET_PENDING) {                                         // Park until the resolver catches up.
+            engine->waiting = true;
+            break;
+        }
+        if(state == CPSCAN_TARGET_FAILED && job->permutationBits > 0) {               // Its other ports are spread over the whole scan.
+            engine->chunkNext++;
+            continue;
+        }
+        if(state == CPSCAN_TARGET_FAILED) {                                          // Skip the rest of this host's ports in the block.
+            engine->chunkNext = (target + 1) * job->portCount < engine->chunkEnd ? (target + 1) * job->portCount : engine->chunkEnd;
+            continue;
+        }
+
+        if(IsPortDecided(job, index) == true) {                          // Answered before the scan was interrupted.
+            CountMetric(&engine->metrics->resumed, 1);
+            engine->chunkNext++;
+            continue;
+        }
+        if(PaceProbe(job, &job->targets->items[target], &engine->resumeAt) == false) break;   // Sleep in epoll until the limits allow more.
+        if(LaunchProbe(engine, target, (unsigned short)(job->portStart + index % job->portCount), 0) == false) break;   // Backing off, resumeAt is set.
+        engine->chunkNext++;
+        launched++;
+    }
+    if(engine->udp) FlushUdpBatch(engine);
+
+    if(engine->heapSize == 0 && engine->waiting == false && engine->resumeAt == 0 && reading == false) {
+        FlushOutput(&engine->output);
+        return ClaimPortBlock(engine);
+    }
+
+    int waitMs = EngineWaitTime(engine);
+    if(waitMs != 0) FlushOutput(&engine->output);                                    // About to sleep, push out what we have.
+    if(block == false) waitMs = 0;                                                  // The caller's own loop does the sleeping.
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int count = epoll_wait(engine->epfd, events, MAX_EPOLL_EVENTS, waitMs);
+    for(int index = 0; index < count; index++) {
+        if(events[index].data.u64 == RESOLVER_EVENT) continue;
+        if(events[index].data.u64 == UDP_EVENT) {
+            for(int family = 0; family < 2; family++) {
+                if(engine->udp->sockets[family] >= 0) DrainUdpSocket(engine, engine->udp->sockets[family]);
+            }
+            continue;
+        }
+        if(events[index].data.u64 & BANNER_EVENT) {
+            ReadBanner(engine, events[index].data.u64 & ~BANNER_EVENT);
+            continue;
+        }
+        size_t slot = events[index].data.u64;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(engine->probes[slot].fd, SOL_SOCKET, SO_ERROR, &err, &len);     // Result of the asynchronous connect.
+        if(err != ECONNREFUSED) CountError(engine->metrics, err);
+        CompleteProbe(engine, slot, ClassifyConnectError(err));
+    }
+
+    if(count == MAX_EPOLL_EVENTS) return true;                                      // Drain pending events before expiring anything.
+
+    long long now = GetMonotonicTime();
+    while(engine->heapSize > 0 && engine->probes[engine->heap[0]].deadline <= now) {  // Nothing came back in time.
+        if(engine->udp) ExpireUdpProbe(engine, engine->heap[0], now);
+        else if(engine->probes[engine->heap[0]].fd < 0 || engine->probes[engine->heap[0]].attempt < engine->config->retries) RetryProbe(engine, engine->heap[0]);
+        else {
+            CountMetric(&engine->metrics->timeouts, 1);
+            CompleteProbe(engine, engine->heap[0], CPSCAN_PORT_FILTERED);
+        }
+    }
+    if(engine->udp) FlushUdpBatch(engine);
+    if(banners) ExpireBannerReads(engine, now);
+    __atomic_store_n(&engine->metrics->inFlight, engine->heapSize, __ATOMIC_RELAXED);
+
+    reading = banners && banners->head != SIZE_MAX;
+    return engine->heapSize > 0 || engine->waiting == true || engine->resumeAt != 0 || reading == true || ClaimPortBlock(engine) == true;
+}
+
+/*
+Function marks a worker or SYN thread as done and wakes whoever drives the scan, so it notices without polling.
+Params:
+    PCPSCAN_JOB job     -       [The scan the thread belonged to.]
+Returns nothing.
+*/
+static void FinishScanThread(PCPSCAN_JOB job) {
+    unsigned long long one = 1;
+    __atomic_sub_fetch(&job->activeThreads, 1, __ATOMIC_RELEASE);
+    if(write(job->wakeEvent, &one, sizeof(one)) < 0) return;
+}
+
+/*
+Function is the entry point of a worker thread, it drives one engine until the job runs dry.
+Params:
+    void *arg       -       [The worker's PSCAN_ENGINE.]
+Returns void*.
+*/
+static void *ScanWorker(void *arg) {
+    PSCAN_ENGINE engine = (PSCAN_ENGINE)arg;
+    while(EngineStep(engine, true) == true);
+    FlushOutput(&engine->output);
+    FinishScanThread(engine->job);
+    return NULL;
+}
+
+/*
+Function sets up the engines that scan every target's port range with many concurrent connects, and starts a
+thread for each one but engine zero, which runs on the thread driving the scan.
+Params:
+    PCPSCAN_JOB job             -       [Targets, ports, protocol, window and thread count for every probe.]
+Returns bool (false when not even engine zero could be set up).
+*/
+static bool StartEngines(PCPSCAN_JOB job) {
+    struct rlimit limit;
+    size_t window = job->config->concurrency;
+    size_t threads = job->config->threads;
+    size_t banners = job->config->banners == true ? job->config->bannerWindow : 0;
+    if(job->config->pt == CPSCAN_TCP && getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) { // Each connect and banner read needs its own descriptor.
+        size_t reserved = RESERVED_DESCRIPTORS + threads + banners;
+        rlim_t wanted = window + reserved;
+        if(wanted > limit.rlim_cur) {                                               // Raise the soft limit as far as the hard cap allows.
+            struct rlimit raised = {wanted < limit.rlim_max ? wanted : limit.rlim_max, limit.rlim_max};
+            if(setrlimit(RLIMIT_NOFILE, &raised) == 0) limit.rlim_cur = raised.rlim_cur;
+        }
+        size_t usable = limit.rlim_cur > reserved ? limit.rlim_cur - reserved : 1;
+        if(window > usable) {
+            if(job->config->debug == true) ReportNotice(job->config, CPSCAN_ORANGE, "[Only %lu sockets fit under RLIMIT_NOFILE, scanning with that window]", usable);
+            window = usable;
+        }
+    }
+    if(threads > window) threads = window;
+
+    job->engines = calloc(threads, sizeof(SCAN_ENGINE));
+    job->workers = calloc(threads, sizeof(pthread_t));
+    if(!job->engines || !job->workers) {
+        ReportNotice(job->config, CPSCAN_RED, "[Unable to initialise the scan engine]");
+        return false;
+    }
+
+    fflush(stdout);                                                                 // Workers write to the descriptor directly.
+    for(size_t index = 0; index < threads; index++) {                                // Split the socket budget between the workers.
+        PSCAN_ENGINE engine = &job->engines[index];
+        size_t budget = window / threads + (index < window % threads ? 1 : 0);
+        size_t reads = banners / threads + (index < banners % threads ? 1 : 0);
+        if(InitScanEngine(engine, job, budget, &job->metrics[index]) == false || (banners > 0 && InitBannerStage(engine, reads > 0 ? reads : 1) == false)) {
+            FreeScanEngine(engine);
+            break;
+        }
+        if(index > 0) {
+            __atomic_add_fetch(&job->activeThreads, 1, __ATOMIC_RELAXED);
+            if(pthread_create(&job->workers[index], NULL, ScanWorker, engine) != 0) {
+                __atomic_sub_fetch(&job->activeThreads, 1, __ATOMIC_RELAXED);
+                FreeScanEngine(engine);
+                break;
+            }
+        }
+        job->engineCount++;
+    }
+    job->stepping = job->engineCount > 0;
+    return job->stepping;
+}
+
+/*
+Function mixes the probe's addressing into a sequence number so replies can be matched without per-probe state.
+Params:
+    PSYN_SCANNER scanner        -       [The scanner holding the secret.]
+    unsigned int address        -       [Target address in network byte order.]
+    unsigned short port         -       [Target port.]
+Returns unsigned int.
+*/
+static unsigned int SynCookie(PSYN_SCANNER scanner, unsigned int address, unsigned short port) {
+    return (unsigned int)MixBits(scanner->secret ^ ((unsigned long long)address << 32 | (unsigned long long)port << 16 | scanner->sourcePort));
+}
+
+/*
+Function adds a run of 16 bit words to a one's complement checksum accumulator.
+Params:
+    unsigned int sum            -       [The running sum.]
+    const unsigned char *data   -       [The bytes to add, an even number of them.]
+    size_t length               -       [How many bytes to add.]
+Returns unsigned int.
+*/
+static unsigned int ChecksumAdd(unsigned int sum, const unsigned char *data, size_t length) {
+    for(size_t index = 0; index + 1 < length; index += 2) {
+        unsigned short word;
+        memcpy(&word, data + index, sizeof(word));
+        sum += word;
+    }
+    return sum;
+}
+
+/*
+Function folds a checksum accumulator down to its final 16 bit value.
+Params:
+    unsigned int sum    -       [The running sum.]
+Returns unsigned short.
+*/
+static unsigned short ChecksumFold(unsigned int sum) {
+    while(sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (unsigned short)~sum;
+}
+
+/*
+Function builds the ip/tcp SYN packet that every probe is copied from and pre-sums its checksum.
+The destination address, port and sequence number are left at zero and added per probe.
+Params:
+    PSYN_SCANNER scanner    -       [The scanner to fill in.]
+Returns nothing.
+*/
+static void BuildSynTemplate(PSYN_SCANNER scanner) {
+    struct iphdr *ip = (struct iphdr*)scanner->packet;
+    struct tcphdr *tcp = (struct tcphdr*)(scanner->packet + sizeof(struct iphdr));
+    unsigned char *options = scanner->packet + sizeof(struct iphdr) + sizeof(struct tcphdr);
+
+    memset(scanner->packet, 0, SYN_PACKET_SIZE);
+    ip->version = 4;
+    ip->ihl = sizeof(struct iphdr) / 4;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;                                     // Length, id and checksum are filled by the kernel.
+    ip->saddr = scanner->sourceAddress;
+
+    tcp->source = htons(scanner->sourcePort);
+    tcp->doff = (sizeof(struct tcphdr) + 4) / 4;
+    tcp->syn = 1;
+    tcp->window = htons(1024);
+    options[0] = 2;                                                 // MSS option so the probe looks like a normal SYN.
+    options[1] = 4;
+    options[2] = 1460 >> 8;
+    options[3] = 1460 & 0xff;
+
+    unsigned char pseudo[12] = {0};                                 // The tcp checksum covers a pseudo ip header too.
+    memcpy(pseudo, &ip->saddr, 4);
+    pseudo[9] = IPPROTO_TCP;
+    pseudo[11] = SYN_PACKET_SIZE - sizeof(struct iphdr);
+    scanner->templateSum = ChecksumAdd(0, pseudo, sizeof(pseudo));
+    scanner->templateSum = ChecksumAdd(scanner->templateSum, (unsigned char*)tcp, SYN_PACKET_SIZE - sizeof(struct iphdr));
+}
+
+/*
+Function stamps the address, port, cookie and checksum of one probe onto a copy of the template.
+Params:
+    PSYN_SCANNER scanner        -       [The scanner holding the template.]
+    unsigned char *packet       -       [The buffer to fill.]
+    unsigned int address        -       [The destination address in network byte order.]
+    unsigned short port         -       [The destination port.]
+Returns nothing.
+*/
+static void StampSynPacket(PSYN_SCANNER scanner, unsigned char *packet, unsigned int address, unsigned short port) {
+    struct iphdr *ip = (struct iphdr*)packet;
+    struct tcphdr *tcp = (struct tcphdr*)(packet + sizeof(struct iphdr));
+    memcpy(packet, scanner->packet, SYN_PACKET_SIZE);
+    ip->daddr = address;
+    tcp->dest = htons(port);
+    tcp->seq = htonl(SynCookie(scanner, address, port));
+
+    unsigned int sum = ChecksumAdd(scanner->templateSum, (unsigned char*)&ip->daddr, sizeof(ip->daddr));
+    sum = ChecksumAdd(sum, (unsigned char*)&tcp->dest, sizeof(tcp->dest));
+    tcp->check = ChecksumFold(ChecksumAdd(sum, (unsigned char*)&tcp->seq, sizeof(tcp->seq)));
+}
+
+/*
+Function records which target an ipv4 address belongs to so the receiver can find it. Targets repeating an
+address are chained behind the first, which is always the lowest index. Only the sender writes.
+Params:
+    PSYN_SCANNER scanner    -       [The scanner that owns the map.]
+    unsigned int address    -       [The address in network byte order.]
+    size_t target           -       [Index of the target.]
+Returns nothing.
+*/
+static void MapTargetAddress(PSYN_SCANNER scanner, unsigned int address, size_t target) {
+    size_t slot = (address * 2654435761U) & (scanner->addressMapSize - 1);
+    while(scanner->addressKeys[slot] != 0) {
+        if(scanner->addressKeys[slot] == address) {                 // Repeats get every reply too.
+            size_t last = scanner->addressTargets[slot];
+            while(last != target && scanner->sameAddress[last] != 0) last = scanner->sameAddress[last];
+            if(last != target) __atomic_store_n(&scanner->sameAddress[last], (unsigned int)target, __ATOMIC_RELEASE);
+            return;
+        }
+        slot = (slot + 1) & (scanner->addressMapSize - 1);
+    }
+    scanner->addressTargets[slot] = target;
+    __atomic_store_n(&scanner->addressKeys[slot], address, __ATOMIC_RELEASE);
+}
+
+/*
+Function finds the first target an ipv4 address belongs to, sameAddress leads to the others.
+Params:
+    PSYN_SCANNER scanner    -       [The scanner that owns the map.]
+    unsigned int address    -       [The address in network byte order.]
+Returns size_t (SIZE_MAX when the address is not being scanned).
+*/
+static size_t LookupTargetAddress(PSYN_SCANNER scanner, unsigned int address) {
+    size_t slot = (address * 2654435761U) & (scanner->addressMapSize - 1);
+    while(true) {
+        unsigned int key = __atomic_load_n(&scanner->addressKeys[slot], __ATOMIC_ACQUIRE);
+        if(key == address) return scanner->addressTargets[slot];
+        if(key == 0) return SIZE_MAX;
+        slot = (slot + 1) & (scanner->addressMapSize - 1);
+    }
+}
+
+/*
+Function gets a target ready for probing: finds our source address on its route and registers it with the receiver.
+Params:
+    PSYN_SCANNER scanner    -       [The scanner.]
+    size_t index            -       [Index of the target.]
+Returns bool (false when the target cannot be SYN scanned).
+*/
+static bool PrepareSynTarget(PSYN_SCANNER scanner, size_t index) {
+    PCPSCAN_TARGET target = &scanner->job->targets->items[index];
+    if(target->address.sa.sa_family != AF_INET) {
+        scanner->skipped++;
+        return false;
+    }
+
+    CPSCAN_ADDRESS local;                                           // Let the routing table pick our source address.
+    socklen_t len = sizeof(local);
+    CPSCAN_ADDRESS route = target->address;
+    route.v4.sin_port = htons(scanner->sourcePort);
+    struct sockaddr unspec = {0};
+    unspec.sa_family = AF_UNSPEC;                                   // Drop the previous route, or the old source address sticks.
+    connect(scanner->routeSocket, &unspec, sizeof(unspec));
+    if(connect(scanner->routeSocket, &route.sa, sizeof(struct sockaddr_in)) < 0 || getsockname(scanner->routeSocket, &local.sa, &len) < 0) return false;
+
+    if(local.v4.sin_addr.s_addr != scanner->sourceAddress) {        // New outgoing interface, rebuild the template.
+        scanner->sourceAddress = local.v4.sin_addr.s_addr;
+        BuildSynTemplate(scanner);
+    }
+    MapTargetAddress(scanner, target->address.v4.sin_addr.s_addr, index);
+    return true;
+}
+
+/*
+Function blocks the sender until a target has finished resolving.
+Params:
+    PSYN_SCANNER scanner    -       [The scanner.]
+    int waitfd              -       [Epoll instance watching the resolver event.]
+    size_t index            -       [Index of the target.]
+Returns nothing.
+*/
+static void WaitForTarget(PSYN_SCANNER scanner, int waitfd, size_t index) {
+    struct epoll_event ev;
+    while(__atomic_load_n(&scanner->job->targets->items[index].state, __ATOMIC_ACQUIRE) == CPSCAN_TARGET_PENDING) epoll_wait(waitfd, &ev, 1, 100);
+}
+
+/*
+Function writes a batch of crafted packets to the raw socket.
+Params:
+    PSYN_SCANNER scanner    -       [The scanner that owns the socket.]
+    struct mmsghdr *msgs    -       [The prepared messages.]
+    unsigned int count      -       [How many messages to send.]
+Returns nothing.
+*/
+static void SendSynBatch(PSYN_SCANNER scanner, struct mmsghdr *msgs, unsigned int count) {
+    unsigned int sent = 0;
+    while(sent < count) {
+        int result = sendmmsg(scanner->sendSocket, msgs + sent, count - sent, 0);
+        if(result > 0) sent += result;
+        else if(errno == ENOBUFS || errno == EAGAIN || errno == EINTR) {
+            CountError(scanner->metrics, errno);
+            struct timespec pause = {0, 100000};                    // The device queue is full, give it a moment.
+            nanosleep(&pause, NULL);
+        }
+        else {
+            CountError(scanner->metrics, errno);
+            break;
+        }
+    }
+    CountMetric(&scanner->metrics->sent, sent);
+}
+
+/*
+Function sends the SYN probes: it walks every target's port range, retransmitting to ports that stayed silent.
+Params:
+    PSYN_SCANNER scanner        -       [The scanner to send for.]
+Returns nothing.
+*/
+static void SynSender(PSYN_SCANNER scanner) {
+    PCPSCAN_JOB job = scanner->job;
+    static __thread unsigned char packets[SYN_BATCH_SIZE][SYN_PACKET_SIZE];
+    struct sockaddr_in destinations[SYN_BATCH_SIZE];
+    struct mmsghdr msgs[SYN_BATCH_SIZE];
+    struct iovec iov[SYN_BATCH_SIZE];
+
+    memset(msgs, 0, sizeof(msgs));
+    memset(destinations, 0, sizeof(destinations));
+    for(size_t index = 0; index < SYN_BATCH_SIZE; index++) {
+        destinations[index].sin_family = AF_INET;
+        iov[index].iov_base = packets[index];
+        iov[index].iov_len = SYN_PACKET_SIZE;
+        msgs[index].msg_hdr.msg_iov = &iov[index];
+        msgs[index].msg_hdr.msg_iovlen = 1;
+        msgs[index].msg_hdr.msg_name = &destinations[index];
+        msgs[index].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    int waitfd = epoll_create1(EPOLL_CLOEXEC);                      // Edge triggered wake ups from the resolver.
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    epoll_ctl(waitfd, EPOLL_CTL_ADD, job->wakeEvent, &ev);
+
+    for(size_t pass = 0; pass <= scanner->config->retries; pass++) {
+        unsigned int count = 0;
+        for(size_t position = 0; position < job->totalProbes; position++) {
+            size_t index = PermuteProbe(job, position);
+            size_t target = index / job->portCount;
+            if(scanner->sources[target] == 0) {                     // First probe of a host, wait for its name alone as the connect engine does.
+                if(__atomic_load_n(&job->targets->items[target].state, __ATOMIC_ACQUIRE) == CPSCAN_TARGET_PENDING) {
+                    if(count > 0) SendSynBatch(scanner, msgs, count);       // Nothing waits in the batch while the resolver works.
+                    count = 0;
+                    WaitForTarget(scanner, waitfd, target);
+                }
+                bool usable = job->targets->items[target].state == CPSCAN_TARGET_RESOLVED && PrepareSynTarget(scanner, target) == true;
+                scanner->sources[target] = usable == true ? scanner->sourceAddress : SYN_UNROUTABLE;
+            }
+            if(scanner->sources[target] == SYN_UNROUTABLE) {        // Unresolved, ipv6 or unroutable.
+                if(job->permutationBits == 0) position = (target + 1) * job->portCount - 1;   // Skip the rest of its ports.
+                continue;
+            }
+            if(scanner->sources[target] != scanner->sourceAddress) {    // Behind another interface than the last probe.
+                scanner->sourceAddress = scanner->sources[target];
+                BuildSynTemplate(scanner);
+            }
+            unsigned int address = job->targets->items[target].address.v4.sin_addr.s_addr;
+
+            if(pass > 0 && __atomic_load_n(&scanner->answered[index / 8], __ATOMIC_RELAXED) & (1 << (index % 8))) continue;
+            if(pass == 0 && IsPortDecided(job, index) == true) {            // Answered before the scan was interrupted.
+                __atomic_fetch_or(&scanner->answered[index / 8], 1 << (index % 8), __ATOMIC_RELAXED);
+                CountMetric(&scanner->metrics->resumed, 1);
+                continue;
+            }
+            long long resumeAt;
+            while(PaceProbe(job, &job->targets->items[target], &resumeAt) == false) {
+                if(count > 0) SendSynBatch(scanner, msgs, count);                   // Nothing waits in the batch while we sleep.
+                count = 0;
+                struct timespec until = {resumeAt / 1000000, (resumeAt % 1000000) * 1000};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+            }
+            if(pass > 0) {                                                  // Still silent after the last pass.
+                CountMetric(&scanner->metrics->timeouts, 1);
+                CountMetric(&scanner->metrics->retries, 1);
+            }
+            destinations[count].sin_addr.s_addr = address;
+            StampSynPacket(scanner, packets[count], address, (unsigned short)(job->portStart + index % job->portCount));
+            if(++count == SYN_BATCH_SIZE) {
+                SendSynBatch(scanner, msgs, count);
+                count = 0;
+            }
+        }
+        if(count > 0) SendSynBatch(scanner, msgs, count);
+
+        struct timespec wait = {scanner->config->timeout / 1000, (scanner->config->timeout % 1000) * 1000000};
+        nanosleep(&wait, NULL);                                     // Give the stragglers time to answer.
+    }
+
+    close(waitfd);
+    __atomic_store_n(&scanner->stop, true, __ATOMIC_RELEASE);
+}
+
+/*
+Function handles one packet read from the raw socket.
+Params:
+    PSYN_SCANNER scanner        -       [The scanner the reply belongs to.]
+    const unsigned char *data   -       [The ip packet.]
+    size_t length               -       [Bytes received.]
+Returns nothing.
+*/
+static void HandleSynReply(PSYN_SCANNER scanner, const unsigned char *data, size_t length) {
+    PCPSCAN_JOB job = scanner->job;
+    if(length < sizeof(struct iphdr)) return;
+    const struct iphdr *ip = (const struct iphdr*)data;
+    size_t ipLength = ip->ihl * 4;
+    if(ip->protocol != IPPROTO_TCP || length < ipLength + sizeof(struct tcphdr)) return;
+
+    const struct tcphdr *tcp = (const struct tcphdr*)(data + ipLength);
+    unsigned short port = ntohs(tcp->source);
+    if(ntohs(tcp->dest) != scanner->sourcePort || tcp->ack == 0) return;    // Only answers to our probes carry our ack.
+    if(port < job->portStart || port - job->portStart >= job->portCount) return;
+    if(ntohl(tcp->ack_seq) != SynCookie(scanner, ip->saddr, port) + 1) return;
+
+    size_t target = LookupTargetAddress(scanner, ip->saddr);
+    while(target != SIZE_MAX) {                                     // Every target listing the address.
+        size_t index = target * job->portCount + (port - job->portStart);
+        unsigned char bit = 1 << (index % 8);
+        bool repeat = (__atomic_fetch_or(&scanner->answered[index / 8], bit, __ATOMIC_RELAXED) & bit) != 0;   // Retransmits can be answered twice.
+        if(repeat == false && tcp->syn == 1) ReportResult(&scanner->output, job, target, port, CPSCAN_PORT_OPEN);
+        else if(repeat == false && tcp->rst == 1) ReportResult(&scanner->output, job, target, port, CPSCAN_PORT_CLOSED);
+
+        size_t next = __atomic_load_n(&scanner->sameAddress[target], __ATOMIC_ACQUIRE);
+        target = next != 0 ? next : SIZE_MAX;
+    }
+}
+
+/*
+Function is the receiver thread: it drains SYN-ACK and RST replies from the raw socket in batches.
+Params:
+    void *arg       -       [The PSYN_SCANNER.]
+Returns void*.
+*/
+static void *SynReceiver(void *arg) {
+    PSYN_SCANNER scanner = (PSYN_SCANNER)arg;
+    static __thread unsigned char buffers[SYN_BATCH_SIZE][SYN_RECEIVE_SIZE];
+    struct mmsghdr msgs[SYN_BATCH_SIZE];
+    struct iovec iov[SYN_BATCH_SIZE];
+
+    memset(msgs, 0, sizeof(msgs));
+    for(size_t index = 0; index < SYN_BATCH_SIZE; index++) {
+        iov[index].iov_base = buffers[index];
+        iov[index].iov_len = SYN_RECEIVE_SIZE;
+        msgs[index].msg_hdr.msg_iov = &iov[index];
+        msgs[index].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(true) {
+        int count = recvmmsg(scanner->recvSocket, msgs, SYN_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        for(int index = 0; index < count; index++) HandleSynReply(scanner, buffers[index], msgs[index].msg_len);
+        if(count > 0) continue;
+
+        if(__atomic_load_n(&scanner->stop, __ATOMIC_ACQUIRE) == true) break;
+        FlushOutput(&scanner->output);                              // Idle, push out what we have.
+        struct pollfd pfd = {scanner->recvSocket, POLLIN, 0};
+        poll(&pfd, 1, 50);
+    }
+
+    FlushOutput(&scanner->output);
+    return NULL;
+}
+
+/*
+Function opens the sockets used by the SYN scan.
+Params:
+    PSYN_SCANNER scanner    -       [The scanner to fill in.]
+Returns bool (false when raw sockets are not permitted).
+*/
+static bool OpenSynSockets(PSYN_SCANNER scanner) {
+    scanner->routeSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);  // Only used for route lookups.
+    scanner->sendSocket = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);      // IPPROTO_RAW implies IP_HDRINCL.
+    scanner->recvSocket = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(scanner->routeSocket < 0 || scanner->sendSocket < 0 || scanner->recvSocket < 0) return false;
+
+    struct sock_filter code[] = {                                   // Only hand us packets addressed to our source port.
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, scanner->sourcePort, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    struct sock_fprog filter = {sizeof(code) / sizeof(code[0]), code};
+    setsockopt(scanner->recvSocket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter));
+
+    int size = 8 * 1024 * 1024;
+    setsockopt(scanner->recvSocket, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+    setsockopt(scanner->sendSocket, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size));
+    return true;
+}
+
+/*
+Function releases a SYN scanner and its sockets.
+Params:
+    PSYN_SCANNER scanner        -       [The scanner to tear down.]
+Returns nothing.
+*/
+static void CloseSynScan(PSYN_SCANNER scanner) {
+    if(scanner->routeSocket >= 0) close(scanner->routeSocket);
+    if(scanner->sendSocket >= 0) close(scanner->sendSocket);
+    if(scanner->recvSocket >= 0) close(scanner->recvSocket);
+    if(scanner->answered) munmap(scanner->answered, scanner->answeredSize);
+    free(scanner->addressKeys);
+    free(scanner->addressTargets);
+    free(scanner->sameAddress);
+    free(scanner->sources);
+    free(scanner);
+}
+
+/*
+Function prepares a half-open SYN scan. Only ipv4 targets are probed.
+Params:
+    PCPSCAN_JOB job     -       [Targets, ports and timeout.]
+Returns PSYN_SCANNER (NULL when raw sockets are unavailable).
+*/
+static PSYN_SCANNER OpenSynScan(PCPSCAN_JOB job) {
+    PSYN_SCANNER scanner = calloc(1, sizeof(SYN_SCANNER));
+    if(!scanner) return NULL;
+    scanner->job = job;
+    scanner->config = job->config;
+    scanner->output.writer = job->writer;
+    scanner->output.metrics = &job->metrics[1];
+    scanner->metrics = &job->metrics[0];
+    scanner->routeSocket = -1;
+    scanner->sendSocket = -1;
+    scanner->recvSocket = -1;
+
+    scanner->answeredSize = job->totalProbes / 8 + 1;              // Mostly untouched, so only map pages on demand.
+    scanner->answered = mmap(NULL, scanner->answeredSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(scanner->answered == MAP_FAILED) scanner->answered = NULL;
+    for(scanner->addressMapSize = 64; scanner->addressMapSize < job->targets->count * 2; scanner->addressMapSize *= 2);
+    scanner->addressKeys = calloc(scanner->addressMapSize, sizeof(unsigned int));
+    scanner->addressTargets = calloc(scanner->addressMapSize, sizeof(unsigned int));
+    scanner->sameAddress = calloc(job->targets->count, sizeof(unsigned int));
+    scanner->sources = calloc(job->targets->count, sizeof(unsigned int));
+
+    if(getrandom(&scanner->secret, sizeof(scanner->secret), 0) != sizeof(scanner->secret)) scanner->secret = GetMonotonicTime();
+    scanner->sourcePort = SYN_SOURCE_PORT_BASE + scanner->secret % SYN_SOURCE_PORT_SPAN;   // Above the kernel's ephemeral range.
+
+    if(scanner->answered && scanner->addressKeys && scanner->addressTargets && scanner->sameAddress && scanner->sources && OpenSynSockets(scanner) == true) return scanner;
+    CloseSynScan(scanner);
+    return NULL;
+}
+
+/*
+Function is the SYN scan thread: it sends every probe while a receiver thread collects the replies, then reports
+the ports that stayed silent.
+Params:
+    void *arg       -       [The PSYN_SCANNER.]
+Returns void*.
+*/
+static void *SynScanThread(void *arg) {
+    PSYN_SCANNER scanner = (PSYN_SCANNER)arg;
+    PCPSCAN_JOB job = scanner->job;
+    pthread_t receiver;
+    bool ok = pthread_create(&receiver, NULL, SynReceiver, scanner) == 0;
+    if(ok == true) {
+        SynSender(scanner);
+        pthread_join(receiver, NULL);
+    }
+
+    for(size_t index = 0; ok == true && (job->config->debug == true || job->state || job->watch || job->config->onResult) && index < job->totalProbes; index++) {     // Silence means filtered.
+        size_t target = index / job->portCount;
+        if(job->targets->items[target].state != CPSCAN_TARGET_RESOLVED || job->targets->items[target].address.sa.sa_family != AF_INET) {
+            index = (target + 1) * job->portCount - 1;
+            continue;
+        }
+        if((scanner->answered[index / 8] & (1 << (index % 8))) == 0 && IsPortDecided(job, index) == false) ReportResult(&scanner->output, job, target, (unsigned short)(job->portStart + index % job->portCount), CPSCAN_PORT_FILTERED);
+    }
+    if(scanner->skipped > 0) ReportMessage(&scanner->output, job->config, "%s[Skipped %lu ipv6 targets, -sS is ipv4 only]%s\n", clr(job->config->colour, CPSCAN_ORANGE), scanner->skipped, CPSCAN_DEFAULT_COLOUR(job->config->colour));
+    if(ok == false) ReportOutputNotice(&scanner->output, job->config, CPSCAN_RED, "[Unable to start the SYN receiver]");
+    FlushOutput(&scanner->output);
+    FinishScanThread(job);
+    return NULL;
+}
+
+/*
+Function formats a target's address as text.
+Params:
+    PCPSCAN_TARGET target -       [The target.]
+    char *output        -       [Buffer of at least INET6_ADDRSTRLEN bytes.]
+Returns nothing.
+*/
+void FormatTargetAddress(PCPSCAN_TARGET target, char *output) {
+    output[0] = '\0';
+    if(target->address.sa.sa_family == AF_INET) inet_ntop(AF_INET, &target->address.v4.sin_addr, output, INET6_ADDRSTRLEN);
+    else if(target->address.sa.sa_family == AF_INET6) inet_ntop(AF_INET6, &target->address.v6.sin6_addr, output, INET6_ADDRSTRLEN);
+}
+
+/*
+Function hashes a hostname for the name cache.
+Params:
+    const char *name    -       [The hostname.]
+Returns size_t.
+*/
+static size_t HashName(const char *name) {
+    size_t hash = 14695981039346656037ULL;                          // FNV-1a, names are compared case insensitively.
+    for(; *name; name++) {
+        hash ^= (unsigned char)tolower((unsigned char)*name);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+Function grows the name cache so lookups stay short.
+Params:
+    PCPSCAN_TARGET_LIST list -       [The list that owns the cache.]
+Returns bool.
+*/
+static bool GrowNameCache(PCPSCAN_TARGET_LIST list) {
+    size_t size = list->nameCacheSize ? list->nameCacheSize * 2 : 256;
+    size_t *cache = calloc(size, sizeof(size_t));
+    if(!cache) return false;
+
+    for(size_t index = 0; index < list->nameCacheSize; index++) {   // Rehash every canonical name.
+        size_t entry = list->nameCache[index];
+        if(entry == 0) continue;
+        size_t slot = HashName(list->items[entry - 1].name) & (size - 1);
+        while(cache[slot] != 0) slot = (slot + 1) & (size - 1);
+        cache[slot] = entry;
+    }
+
+    free(list->nameCache);
+    list->nameCache = cache;
+    list->nameCacheSize = size;
+    return true;
+}
+
+/*
+Function appends an empty target to the list.
+Params:
+    PCPSCAN_TARGET_LIST list -       [The list to grow.]
+Returns PCPSCAN_TARGET (NULL when the list is full).
+*/
+static PCPSCAN_TARGET AppendTarget(PCPSCAN_TARGET_LIST list) {
+    if(list->count >= MAX_TARGETS) return NULL;
+    if(list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        PCPSCAN_TARGET items = realloc(list->items, capacity * sizeof(CPSCAN_TARGET));
+        if(!items) return NULL;
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    PCPSCAN_TARGET target = &list->items[list->count++];
+    memset(target, 0, sizeof(CPSCAN_TARGET));
+    return target;
+}
+
+/*
+Function adds a hostname to the list, sharing one lookup between repeats of the same name.
+Params:
+    PCPSCAN_TARGET_LIST list -       [The list to add to.]
+    const char *name    -       [The hostname.]
+Returns bool.
+*/
+static bool AddHostname(PCPSCAN_TARGET_LIST list, const char *name) {
+    if((list->nameCount + 1) * 2 > list->nameCacheSize && GrowNameCache(list) == false) return false;
+
+    size_t slot = HashName(name) & (list->nameCacheSize - 1);
+    while(list->nameCache[slot] != 0 && strcasecmp(list->items[list->nameCache[slot] - 1].name, name) != 0) slot = (slot + 1) & (list->nameCacheSize - 1);
+
+    PCPSCAN_TARGET target = AppendTarget(list);
+    if(!target) return false;
+    target->state = CPSCAN_TARGET_PENDING;
+
+    if(list->nameCache[slot] != 0) {                                // Seen before, ride along with the first lookup.
+        PCPSCAN_TARGET first = &list->items[list->nameCache[slot] - 1];
+        target->name = first->name;
+        target->alias = true;
+        target->nextAlias = first->nextAlias;
+        first->nextAlias = list->count - 1;
+        return true;
+    }
+
+    target->name = strdup(name);
+    if(!target->name) {
+        list->count--;
+        return false;
+    }
+    list->nameCache[slot] = list->count;
+    list->nameCount++;
+    return true;
+}
+
+/*
+Function adds a run of consecutive addresses of one family to the list. Every address takes a whole CPSCAN_TARGET,
+so a run may hold at most MAX_RANGE_TARGETS of them, a /16.
+Params:
+    PCPSCAN_TARGET_LIST list    -       [The list to add to.]
+    int family                  -       [AF_INET or AF_INET6.]
+    const unsigned char *first  -       [The first address in network byte order.]
+    unsigned long long count    -       [How many addresses to add.]
+Returns bool.
+*/
+static bool AddAddressRange(PCPSCAN_TARGET_LIST list, int family, const unsigned char *first, unsigned long long count) {
+    if(count > MAX_RANGE_TARGETS) {
+        ReportNotice(list->config, CPSCAN_RED, "[Address ranges may hold at most %llu addresses, split larger ones up]", MAX_RANGE_TARGETS);
+        return false;
+    }
+    if(count > MAX_TARGETS - list->count) {
+        ReportNotice(list->config, CPSCAN_RED, "[Too many targets]");
+        return false;
+    }
+
+    unsigned char address[16];
+    size_t length = family == AF_INET ? 4 : 16;
+    memcpy(address, first, length);
+
+    for(unsigned long long index = 0; index < count; index++) {
+        PCPSCAN_TARGET target = AppendTarget(list);
+        if(!target) return false;
+        target->state = CPSCAN_TARGET_RESOLVED;
+        target->address.sa.sa_family = family;
+        if(family == AF_INET) memcpy(&target->address.v4.sin_addr, address, length);
+        else memcpy(&target->address.v6.sin6_addr, address, length);
+
+        for(size_t byte = length; byte-- > 0;) {                    // Big endian increment.
+            if(++address[byte] != 0) break;
+        }
+    }
+
+    return true;
+}
+
+/*
+Function parses one target specification: a hostname, an address, a CIDR block or an ipv4 range.
+Params:
+    PCPSCAN_TARGET_LIST list -       [The list to add to.]
+    const char *spec    -       [e.g. host.com, 10.0.0.1, 10.0.0.0/24, 10.0.0.1-50, 10.0.0.1-10.0.1.7, ::1, 2001:db8::/120]
+Returns bool.
+*/
+bool ParseTargetSpec(PCPSCAN_TARGET_LIST list, const char *spec) {
+    char text[256];
+    unsigned char address[16];
+    if(strlen(spec) == 0 || strlen(spec) >= sizeof(text)) return false;
+    strcpy(text, spec);
+
+    char *slash = strchr(text, '/');
+    if(slash) {                                                     // CIDR block.
+        *slash = '\0';
+        char *end = NULL;
+        long prefix = strtol(slash + 1, &end, 10);
+        int family = inet_pton(AF_INET, text, address) == 1 ? AF_INET : (inet_pton(AF_INET6, text, address) == 1 ? AF_INET6 : 0);
+        int bits = family == AF_INET ? 32 : 128;
+        if(family == 0 || *end != '\0' || end == slash + 1 || prefix < 0 || prefix > bits || bits - prefix > 24) return false;
+
+        for(int bit = prefix; bit < bits; bit++) address[bit / 8] &= ~(0x80 >> (bit % 8));     // Start at the network address.
+        return AddAddressRange(list, family, address, 1ULL << (bits - prefix));
+    }
+
+    char *dash = strchr(text, '-');
+    if(dash && inet_pton(AF_INET, (*dash = '\0', text), address) == 1) {      // Ipv4 range, either a.b.c.d-e or a.b.c.d-a.b.c.e.
+        unsigned char last[4];
+        char *end = NULL;
+        if(inet_pton(AF_INET, dash + 1, last) != 1) {
+            long octet = strtol(dash + 1, &end, 10);
+            if(*end != '\0' || end == dash + 1 || octet < address[3] || octet > 255) return false;
+            memcpy(last, address, 3);
+            last[3] = (unsigned char)octet;
+        }
+
+        unsigned int from = ntohl(*(unsigned int*)address);
+        unsigned int to = ntohl(*(unsigned int*)last);
+        if(to < from) return false;
+        return AddAddressRange(list, AF_INET, address, (unsigned long long)to - from + 1);
+    }
+    if(dash) *dash = '-';
+
+    if(inet_pton(AF_INET, text, address) == 1) return AddAddressRange(list, AF_INET, address, 1);
+    if(inet_pton(AF_INET6, text, address) == 1) return AddAddressRange(list, AF_INET6, address, 1);
+    return AddHostname(list, text);
+}
+
+/*
+Function reads target specifications from a file, one or more per line, # starts a comment.
+Params:
+    PCPSCAN_TARGET_LIST list -       [The list to add to.]
+    const char *path    -       [The file to read, - for stdin.]
+Returns bool.
+*/
+bool LoadTargetFile(PCPSCAN_TARGET_LIST list, const char *path) {
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(!file) {
+        ReportNotice(list->config, CPSCAN_RED, "[Unable to open target file %s]", path);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    bool ok = true;
+    while(ok == true && getline(&line, &size, file) >= 0) {
+        char *comment = strchr(line, '#');
+        if(comment) *comment = '\0';
+        for(char *token = strtok(line, " \t\r\n,"); token; token = strtok(NULL, " \t\r\n,")) {
+            if(ParseTargetSpec(list, token) == true) continue;
+            ReportNotice(list->config, CPSCAN_RED, "[Invalid target %s]", token);
+            ok = false;
+            break;
+        }
+    }
+
+    free(line);
+    if(file != stdin) fclose(file);
+    return ok;
+}
+
+/*
+Function releases a target list.
+Params:
+    PCPSCAN_TARGET_LIST list -       [The list to free.]
+Returns nothing.
+*/
+void FreeTargetList(PCPSCAN_TARGET_LIST list) {
+    for(size_t index = 0; index < list->nameCacheSize; index++) {  // Aliases share the first target's string.
+        if(list->nameCache[index] != 0) free(list->items[list->nameCache[index] - 1].name);
+    }
+    free(list->nameCache);
+    free(list->items);
+    memset(list, 0, sizeof(CPSCAN_TARGET_LIST));
+}
+
+/*
+Function publishes the outcome of a lookup to a target and every repeat of its name, then wakes the scanners.
+Params:
+    PCPSCAN_JOB job             -       [The job being resolved.]
+    size_t index                -       [The first target with this name.]
+    struct addrinfo *result     -       [The lookup result, NULL on failure.]
+    POUTPUT_BUFFER out          -       [Where debug and error lines go.]
+Returns nothing.
+*/
+static void PublishResolution(PCPSCAN_JOB job, size_t index, struct addrinfo *result, POUTPUT_BUFFER out) {
+    PCPSCAN_TARGET first = &job->targets->items[index];
+    char text[INET6_ADDRSTRLEN];
+
+    for(size_t current = index; ; current = job->targets->items[current].nextAlias) {
+        PCPSCAN_TARGET target = &job->targets->items[current];
+        if(result) memcpy(&target->address, result->ai_addr, result->ai_addrlen);
+        if(result) RecordStateTarget(job, current);
+        __atomic_store_n(&target->state, result ? CPSCAN_TARGET_RESOLVED : CPSCAN_TARGET_FAILED, __ATOMIC_RELEASE);
+        if(target->nextAlias == 0) break;
+    }
+
+    if(out->metrics) CountMetric(result ? &out->metrics->resolved : &out->metrics->unresolved, 1);
+    if(result) {
+        FormatTargetAddress(first, text);
+        if(job->config->debug == true) ReportMessage(out, job->config, "%s[%s] -> %s[%s]%s\n", clr(job->config->colour, CPSCAN_ORANGE), first->name, clr(job->config->colour, CPSCAN_LIGHT_BLUE), text, CPSCAN_DEFAULT_COLOUR(job->config->colour));
+    }
+    else ReportMessage(out, job->config, "%s[Unable to resolve %s]%s\n", clr(job->config->colour, CPSCAN_RED), first->name, CPSCAN_DEFAULT_COLOUR(job->config->colour));
+
+    unsigned long long one = 1;
+    if(write(job->wakeEvent, &one, sizeof(one)) < 0) return;    // Wake any scanner parked on a pending target.
+}
+
+/*
+Function is the resolver thread: it keeps a window of asynchronous lookups running so resolution overlaps the scan.
+Params:
+    void *arg       -       [The PCPSCAN_JOB.]
+Returns void*.
+*/
+static void *ResolverThread(void *arg) {
+    PCPSCAN_JOB job = (PCPSCAN_JOB)arg;
+    PCPSCAN_TARGET_LIST list = job->targets;
+    struct gaicb requests[RESOLVER_BATCH];
+    struct gaicb *pending[RESOLVER_BATCH] = {0};
+    size_t owners[RESOLVER_BATCH];
+    size_t active = 0;
+    size_t next = 0;
+    OUTPUT_BUFFER *out = calloc(1, sizeof(OUTPUT_BUFFER));
+    if(!out) return NULL;
+    out->writer = job->writer;
+    out->metrics = &job->metrics[job->metricsCount - 1];
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;                                    // Ipv4 or ipv6, whichever the resolver prefers.
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    while(true) {
+        for(size_t slot = 0; slot < RESOLVER_BATCH; slot++) {       // Top up the window.
+            if(pending[slot]) continue;
+            while(next < list->count && (list->items[next].state != CPSCAN_TARGET_PENDING || list->items[next].alias == true)) next++;
+            if(next >= list->count) break;
+
+            memset(&requests[slot], 0, sizeof(struct gaicb));
+            requests[slot].ar_name = list->items[next].name;
+            requests[slot].ar_request = &hints;
+            pending[slot] = &requests[slot];
+            if(getaddrinfo_a(GAI_NOWAIT, &pending[slot], 1, NULL) != 0) {
+                pending[slot] = NULL;
+                PublishResolution(job, next, NULL, out);
+            }
+            else {
+                owners[slot] = next;
+                active++;
+            }
+            next++;
+        }
+        if(active == 0 && next >= list->count) break;
+
+        FlushOutput(out);
+        gai_suspend((const struct gaicb * const*)pending, RESOLVER_BATCH, NULL);
+        for(size_t slot = 0; slot < RESOLVER_BATCH; slot++) {
+            if(!pending[slot] || gai_error(pending[slot]) == EAI_INPROGRESS) continue;
+            PublishResolution(job, owners[slot], gai_error(pending[slot]) == 0 ? pending[slot]->ar_result : NULL, out);
+            if(pending[slot]->ar_result) freeaddrinfo(pending[slot]->ar_result);
+            pending[slot] = NULL;
+            active--;
+        }
+    }
+
+    FlushOutput(out);
+    free(out);
+    return NULL;
+}
+
+/*
+Function adds up every thread's counters.
+Params:
+    PCPSCAN_JOB job             -       [The job holding the counters.]
+    PCPSCAN_METRICS total       -       [Filled in with the sums.]
+Returns nothing.
+*/
+void SumMetrics(PCPSCAN_JOB job, PCPSCAN_METRICS total) {
+    unsigned long long *sums = (unsigned long long*)total;                          // Every field is a counter.
+    memset(total, 0, sizeof(CPSCAN_METRICS));
+    for(size_t index = 0; index < job->metricsCount; index++) {
+        unsigned long long *counters = (unsigned long long*)&job->metrics[index];
+        for(size_t field = 0; field < sizeof(CPSCAN_METRICS) / sizeof(unsigned long long); field++) sums[field] += __atomic_load_n(&counters[field], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+Function writes the scan's metrics as a single json object: probe and result counters, resolver and
+output activity, failed syscalls by errno and a log2 histogram of round trip times for every host that answered.
+Params:
+    PCPSCAN_JOB job     -       [The scan.]
+    FILE *file          -       [Where the object goes.]
+Returns nothing.
+*/
+void WriteMetrics(PCPSCAN_JOB job, FILE *file) {
+    CPSCAN_METRICS total;
+    SumMetrics(job, &total);
+    long long elapsed = GetMonotonicTime() - job->started;
+    unsigned long long written = job->writer ? __atomic_load_n(&job->writer->written, __ATOMIC_RELAXED) : 0;
+    unsigned long long stalls = job->writer ? __atomic_load_n(&job->writer->stalls, __ATOMIC_RELAXED) : 0;
+    fprintf(file, "{\"elapsed_s\":%lld.%06lld,\"probes\":{\"total\":%lu,\"launched\":%llu,\"resumed\":%llu,\"sent\":%llu,\"retries\":%llu,\"timeouts\":%llu,\"in_flight\":%llu},"
+        "\"results\":{\"open\":%llu,\"closed\":%llu,\"filtered\":%llu,\"open|filtered\":%llu,\"banners\":%llu},\"resolver\":{\"resolved\":%llu,\"failed\":%llu},"
+        "\"output\":{\"bytes\":%llu,\"stalls\":%llu},\"errors\":{",
+        elapsed / 1000000, elapsed % 1000000, job->totalProbes, total.sent - total.retries, total.resumed, total.sent, total.retries, total.timeouts, total.inFlight,
+        total.results[CPSCAN_PORT_OPEN], total.results[CPSCAN_PORT_CLOSED], total.results[CPSCAN_PORT_FILTERED], total.results[CPSCAN_PORT_OPEN_FILTERED], total.banners, total.resolved, total.unresolved,
+        written, stalls);
+
+    const char *separator = "";
+    for(int err = 1; err < CPSCAN_ERRNO_LIMIT; err++) {
+        if(total.errors[err] == 0) continue;
+        const char *name = strerrorname_np(err);
+        if(name) fprintf(file, "%s\"%s\":%llu", separator, name, total.errors[err]);
+        else fprintf(file, "%s\"%d\":%llu", separator, err, total.errors[err]);
+        separator = ",";
+    }
+
+    fprintf(file, "},\"hosts\":[");
+    separator = "";
+    for(size_t target = 0; job->rttHistograms && target < job->targets->count; target++) {
+        unsigned int *buckets = &job->rttHistograms[target * RTT_HISTOGRAM_BUCKETS];
+        unsigned int samples = 0;
+        for(int bucket = 0; bucket < RTT_HISTOGRAM_BUCKETS; bucket++) samples += __atomic_load_n(&buckets[bucket], __ATOMIC_RELAXED);
+        if(samples == 0) continue;                                                  // Never answered, or not scanned yet.
+
+        PCPSCAN_TARGET host = &job->targets->items[target];
+        char address[INET6_ADDRSTRLEN];
+        char name[768] = "";
+        FormatTargetAddress(host, address);
+        if(host->name) EscapeJson(host->name, name, sizeof(name));
+        fprintf(file, "%s{%s%s%s\"ip\":\"%s\",\"srtt_us\":%d,\"rttvar_us\":%d,\"rtt_log2_us\":[", separator, host->name ? "\"host\":\"" : "", name,
+            host->name ? "\"," : "", address, __atomic_load_n(&host->srtt, __ATOMIC_RELAXED), __atomic_load_n(&host->rttvar, __ATOMIC_RELAXED));
+        for(int bucket = 0; bucket < RTT_HISTOGRAM_BUCKETS; bucket++) fprintf(file, "%s%u", bucket > 0 ? "," : "", __atomic_load_n(&buckets[bucket], __ATOMIC_RELAXED));
+        fprintf(file, "]}");
+        separator = ",";
+    }
+    fprintf(file, "]}\n");
+    fflush(file);
+}
+
+/*
+Function writes the metrics to the -stats file, or to stderr when none was given.
+Params:
+    PCPSCAN_JOB job     -       [The scan.]
+Returns nothing.
+*/
+void DumpMetrics(PCPSCAN_JOB job) {
+    FILE *file = job->config->statsPath ? fopen(job->config->statsPath, "w") : stderr;
+    if(!file) {
+        ReportNotice(job->config, CPSCAN_RED, "[Unable to open stats file %s]", job->config->statsPath);
+        return;
+    }
+    WriteMetrics(job, file);
+    if(file != stderr) fclose(file);
+}
+
+/*
+Function prints one line of progress to stderr, redrawn in place on a terminal.
+Params:
+    PCPSCAN_JOB job     -       [The scan.]
+    bool last           -       [The scan is over, end the line.]
+Returns nothing.
+*/
+static void PrintProgress(PCPSCAN_JOB job, bool last) {
+    CPSCAN_METRICS total;
+    SumMetrics(job, &total);
+    long long elapsed = GetMonotonicTime() - job->started;
+    unsigned long long launched = total.sent - total.retries + total.resumed;
+    if(launched > job->totalProbes) launched = job->totalProbes;
+    double rate = elapsed > 0 ? launched * 1000000.0 / elapsed : 0;
+
+    char eta[32] = "?";
+    if(rate > 0) {
+        long long seconds = (long long)((job->totalProbes - launched) / rate);
+        snprintf(eta, sizeof(eta), "%lld:%02lld:%02lld", seconds / 3600, seconds / 60 % 60, seconds % 60);
+    }
+    char names[64] = "";
+    unsigned long long resolving = job->pendingNames - total.resolved - total.unresolved;
+    if(resolving > 0) snprintf(names, sizeof(names), "  %llu names resolving", resolving);
+
+    bool terminal = isatty(STDERR_FILENO) == 1;
+    fprintf(stderr, "%s[%5.1f%%] %llu/%lu probes  %.0f/s  %llu in flight  %llu open  %llu timeouts  %llu retries%s  ETA %s%s",
+        terminal == true ? "\r\033[K" : "", job->totalProbes > 0 ? 100.0 * launched / job->totalProbes : 100.0, launched, job->totalProbes, rate,
+        total.inFlight, total.results[CPSCAN_PORT_OPEN], total.timeouts, total.retries, names, eta, terminal == false || last == true ? "\n" : "");
+    fflush(stderr);
+}
+
+/*
+Function is the monitor thread: every second it prints progress and checkpoints the -state file when asked to,
+and it dumps the metrics on the metrics signal.
+Params:
+    void *arg       -       [The PSCAN_MONITOR.]
+Returns void*.
+*/
+static void *MonitorThread(void *arg) {
+    PSCAN_MONITOR monitor = (PSCAN_MONITOR)arg;
+    PCPSCAN_JOB job = monitor->job;
+    struct pollfd fds[2] = {{monitor->stopEvent, POLLIN, 0}, {monitor->signalFd, POLLIN, 0}};
+
+    while(true) {
+        int ready = poll(fds, monitor->signalFd >= 0 ? 2 : 1, job->config->progress == true || job->state ? PROGRESS_INTERVAL : -1);
+        if(ready > 0 && fds[0].revents != 0) break;
+        if(ready > 0 && fds[1].revents != 0) {
+            struct signalfd_siginfo info;
+            if(read(monitor->signalFd, &info, sizeof(info)) == sizeof(info)) DumpMetrics(job);
+        }
+        else if(ready == 0) {
+            if(job->config->progress == true) PrintProgress(job, false);
+            CheckpointState(job, false);
+        }
+    }
+    if(job->config->progress == true) PrintProgress(job, true);
+    return NULL;
+}
+
+/*
+Function starts the monitor thread. The metrics signal must already be blocked so it reaches the monitor's signalfd.
+Params:
+    PSCAN_MONITOR monitor       -       [The monitor to initialise.]
+    PCPSCAN_JOB job             -       [The scan to watch.]
+    const sigset_t *signals     -       [The blocked metrics signal, NULL for none.]
+Returns nothing.
+*/
+static void StartMonitor(PSCAN_MONITOR monitor, PCPSCAN_JOB job, const sigset_t *signals) {
+    memset(monitor, 0, sizeof(SCAN_MONITOR));
+    monitor->job = job;
+    monitor->stopEvent = eventfd(0, EFD_CLOEXEC);
+    monitor->signalFd = signals ? signalfd(-1, signals, SFD_CLOEXEC | SFD_NONBLOCK) : -1;
+    if(monitor->stopEvent >= 0) monitor->running = pthread_create(&monitor->thread, NULL, MonitorThread, monitor) == 0;
+}
+
+/*
+Function stops the monitor thread, which prints the last progress line.
+Params:
+    PSCAN_MONITOR monitor       -       [The monitor to tear down.]
+Returns nothing.
+*/
+static void StopMonitor(PSCAN_MONITOR monitor) {
+    unsigned long long one = 1;
+    if(monitor->running == true && write(monitor->stopEvent, &one, sizeof(one)) == sizeof(one)) pthread_join(monitor->thread, NULL);
+    if(monitor->stopEvent >= 0) close(monitor->stopEvent);
+    if(monitor->signalFd >= 0) close(monitor->signalFd);
+}
+
+/*
+Function fills in the settings every scan starts from: a tcp connect scan on one thread whose results only go to
+the callback, with notices on stderr.
+Params:
+    PCPSCAN_CONFIG config       -       [The settings to initialise.]
+Returns nothing.
+*/
+void InitScanConfig(PCPSCAN_CONFIG config) {
+    memset(config, 0, sizeof(CPSCAN_CONFIG));
+    config->pt = CPSCAN_TCP;
+    config->timeout = DEFAULT_TIMEOUT;
+    config->retries = DEFAULT_RETRIES;
+    config->format = CPSCAN_FORMAT_HUMAN;
+    config->outputFd = -1;
+    config->bannerWindow = DEFAULT_BANNER_WINDOW;
+    config->concurrency = DEFAULT_CONCURRENCY;
+    config->threads = DEFAULT_THREADS;
+    config->watchSlices = DEFAULT_WATCH_SLICES;
+    config->resolveInterval = DEFAULT_RESOLVE_INTERVAL;
+    config->messages = stderr;
+}
+
+/*
+Function prepares a scan of every target's port range. Settings out of range are brought back in line, so the
+config must stay alive and unchanged until the scan is freed. Host names are resolved once the scan starts.
+Params:
+    PCPSCAN_CONFIG      p         -       [Protocol, timeouts, concurrency, output and callback.]
+    PCPSCAN_TARGET_LIST targets   -       [The hosts to scan, kept until the scan is freed.]
+    size_t              portStart -       [The start range to begin the port scan.]
+    size_t              portEnd   -       [The end range to finish the port scan.]
+Returns PCPSCAN_JOB (NULL when the scan could not be set up).
+*/
+PCPSCAN_JOB CreateScan(PCPSCAN_CONFIG p, PCPSCAN_TARGET_LIST targets, size_t portStart, size_t portEnd) {
+    if(targets->count == 0 || portStart > portEnd || portEnd > 65535) {
+        ReportNotice(p, CPSCAN_RED, "[Nothing to scan]");
+        return NULL;
+    }
+
+    if(p->timeout <= 30) p->timeout = DEFAULT_TIMEOUT;                          // Only a starting point, hosts that answer adapt.
+    if(p->retries > MAX_RETRIES) p->retries = MAX_RETRIES;
+    if(p->hostRate > 0 && p->rate > 0 && p->hostRate > p->rate) p->hostRate = p->rate;
+    if(p->concurrency == 0) p->concurrency = DEFAULT_CONCURRENCY;
+    if(p->threads == 0) p->threads = DEFAULT_THREADS;
+    if(p->threads > MAX_THREADS) p->threads = MAX_THREADS;
+    if(p->bannerWindow == 0) p->bannerWindow = DEFAULT_BANNER_WINDOW;
+    if(p->watchSlices == 0) p->watchSlices = DEFAULT_WATCH_SLICES;
+    if(p->synScan == true && p->pt != CPSCAN_TCP) {
+        ReportNotice(p, CPSCAN_ORANGE, "[-sS only applies to tcp, using connect scan]");
+        p->synScan = false;
+    }
+    if(p->banners == true && (p->pt != CPSCAN_TCP || p->synScan == true)) {       // Only a full connect leaves a connection to read from.
+        ReportNotice(p, CPSCAN_ORANGE, "[-banners needs a tcp connect scan, skipping banners]");
+        p->banners = false;
+    }
+
+    PCPSCAN_JOB job = calloc(1, sizeof(CPSCAN_JOB));                            // Everything the scanning threads share.
+    if(!job) {
+        ReportNotice(p, CPSCAN_RED, "[Unable to initialise the scan engine]");
+        return NULL;
+    }
+    job->config = p;
+    job->targets = targets;
+    job->portStart = portStart;
+    job->portCount = portEnd - portStart + 1;
+    job->totalProbes = targets->count * job->portCount;
+    for(size_t index = 0; index < targets->count; index++) {                    // A watch keeps the names it already knows.
+        if(targets->items[index].alias == false && targets->items[index].state == CPSCAN_TARGET_PENDING) job->pendingNames++;
+    }
+    job->wakeEvent = -1;
+    job->pollFd = -1;
+    if(p->randomize == true) InitPermutation(job);
+    if(p->rate > 0) {                                                           // Bursts never run more than a millisecond ahead.
+        job->rate.interval = 1000000000LL / p->rate > 0 ? 1000000000LL / p->rate : 1;
+        job->rate.tolerance = RATE_TOLERANCE;
+    }
+    if(p->hostRate > 0) job->hostGap = 1000000 / p->hostRate > 0 ? 1000000 / p->hostRate : 1;
+    if(p->statePath && OpenStateFile(job, p->statePath, p->resume) == false) {
+        free(job);
+        return NULL;
+    }
+
+    job->metricsCount = p->threads + 2;                                         // Workers or the SYN sender and receiver, plus the resolver.
+    job->metrics = aligned_alloc(64, job->metricsCount * sizeof(CPSCAN_METRICS));
+    job->rttHistogramsSize = targets->count * RTT_HISTOGRAM_BUCKETS * sizeof(unsigned int);
+    job->rttHistograms = mmap(NULL, job->rttHistogramsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);   // Pages appear as hosts answer.
+    if(job->rttHistograms == MAP_FAILED) job->rttHistograms = NULL;
+    job->wakeEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(job->wakeEvent < 0 || !job->metrics) {
+        ReportNotice(p, CPSCAN_RED, "[Unable to initialise the scan engine]");
+        FreeScan(job);
+        return NULL;
+    }
+    memset(job->metrics, 0, job->metricsCount * sizeof(CPSCAN_METRICS));
+    return job;
+}
+
+/*
+Function starts a scan: the output writer, the monitor, the resolver and either the SYN scan thread or every
+worker thread but the first. Engine zero is left for StepScan or RunScan to drive, so the metrics signal is blocked
+in the calling thread until FinishScan, which must run on the same thread.
+Params:
+    PCPSCAN_JOB job     -       [A scan from CreateScan.]
+Returns bool (false when nothing could be started, the scan is already finished then).
+*/
+bool StartScan(PCPSCAN_JOB job) {
+    PCPSCAN_CONFIG p = job->config;
+    if(job->running == true || job->started != 0) return false;                // A scan runs once.
+    job->running = true;
+    job->started = GetMonotonicTime();
+
+    sigemptyset(&job->signals);
+    if(p->metricsSignal > 0) sigaddset(&job->signals, p->metricsSignal);
+    pthread_sigmask(SIG_BLOCK, &job->signals, &job->previousMask);              // Every thread inherits the mask, only the monitor takes the signal.
+    if(p->outputFd >= 0) {
+        fflush(stdout);                                                         // The writer thread uses the descriptor directly.
+        StartOutputWriter(&job->output, p->outputFd, p->format);
+        job->writer = &job->output;
+    }
+    StartMonitor(&job->monitor, job, p->metricsSignal > 0 ? &job->signals : NULL);
+
+    if(job->pendingNames > 0) {                                                 // Resolve host names alongside the scan.
+        if(p->debug == true) ReportNotice(p, CPSCAN_ORANGE, "[Resolving %lu domain names]", job->pendingNames);
+        fflush(stdout);
+        job->resolving = pthread_create(&job->resolver, NULL, ResolverThread, job) == 0;
+        if(job->resolving == false) {
+            for(size_t index = 0; index < job->targets->count; index++) {
+                if(job->targets->items[index].state == CPSCAN_TARGET_PENDING) job->targets->items[index].state = CPSCAN_TARGET_FAILED;
+            }
+            ReportNotice(p, CPSCAN_RED, "[Unable to start the resolver]");
+        }
+    }
+
+    if(p->synScan == true) {
+        job->syn = OpenSynScan(job);
+        __atomic_add_fetch(&job->activeThreads, 1, __ATOMIC_RELAXED);
+        if(job->syn && pthread_create(&job->synThread, NULL, SynScanThread, job->syn) != 0) {
+            CloseSynScan(job->syn);
+            job->syn = NULL;
+        }
+        if(!job->syn) {
+            __atomic_sub_fetch(&job->activeThreads, 1, __ATOMIC_RELAXED);
+            ReportNotice(p, CPSCAN_ORANGE, "[Raw sockets need CAP_NET_RAW, using connect scan]");
+        }
+    }
+    if(!job->syn && StartEngines(job) == false) {                               // Scan ports with in set port range.
+        FinishScan(job);
+        return false;
+    }
+
+    job->pollFd = epoll_create1(EPOLL_CLOEXEC);                                 // Readable whenever StepScan has something to do.
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = RESOLVER_EVENT;
+    if(job->pollFd >= 0) epoll_ctl(job->pollFd, EPOLL_CTL_ADD, job->wakeEvent, &ev);
+    ev.events = EPOLLIN;
+    if(job->pollFd >= 0 && job->stepping == true) epoll_ctl(job->pollFd, EPOLL_CTL_ADD, job->engines[0].epfd, &ev);
+    return true;
+}
+
+/*
+Function returns the descriptor an outside event loop should watch for reading, StepScan is due whenever it is readable.
+Params:
+    PCPSCAN_JOB job     -       [A started scan.]
+Returns int.
+*/
+int GetScanFd(PCPSCAN_JOB job) {
+    return job->pollFd;
+}
+
+/*
+Function returns how long an outside event loop may wait for the scan's descriptor before calling StepScan anyway.
+Params:
+    PCPSCAN_JOB job     -       [A started scan.]
+Returns int (milliseconds, -1 to wait for the descriptor alone).
+*/
+int GetScanTimeout(PCPSCAN_JOB job) {
+    return job->stepping == true ? EngineWaitTime(&job->engines[0]) : -1;
+}
+
+/*
+Function does whatever the scan can do right now without blocking: launches probes from engine zero, collects
+their answers and expires the ones that timed out. Worker and SYN threads carry on in the background.
+Params:
+    PCPSCAN_JOB job     -       [A started scan.]
+Returns bool (true until every thread is done and FinishScan can be called).
+*/
+bool StepScan(PCPSCAN_JOB job) {
+    struct epoll_event events[2];
+    if(job->running == false) return false;
+    if(job->pollFd >= 0) epoll_wait(job->pollFd, events, 2, 0);                 // Consume the wakeup, engine zero reads its own events.
+    if(job->stepping == true) {
+        job->stepping = EngineStep(&job->engines[0], false);
+        if(job->stepping == false) FlushOutput(&job->engines[0].output);
+    }
+    return job->stepping == true || __atomic_load_n(&job->activeThreads, __ATOMIC_ACQUIRE) > 0;
+}
+
+/*
+Function waits for every scan thread, marks the -state file finished and stops the writer and the monitor.
+Params:
+    PCPSCAN_JOB job     -       [A scan whose StepScan returned false, or that RunScan drove.]
+Returns nothing.
+*/
+void FinishScan(PCPSCAN_JOB job) {
+    if(job->running == false) return;
+    for(size_t index = 1; index < job->engineCount; index++) pthread_join(job->workers[index], NULL);
+    if(job->syn) {
+        pthread_join(job->synThread, NULL);
+        CloseSynScan(job->syn);
+        job->syn = NULL;
+    }
+    for(size_t index = 0; index < job->engineCount; index++) FreeScanEngine(&job->engines[index]);
+    free(job->engines);
+    free(job->workers);
+    job->engines = NULL;
+    job->workers = NULL;
+    job->engineCount = 0;
+    job->stepping = false;
+
+    if(job->resolving == true) pthread_join(job->resolver, NULL);
+    job->resolving = false;
+    StopMonitor(&job->monitor);
+    if(job->state) {                                                            // Every port has been through the scan.
+        job->state->finished = GetWallTime();
+        CheckpointState(job, true);
+    }
+    if(job->writer) StopOutputWriter(job->writer);                              // Its counters stay for the metrics.
+    if(job->pollFd >= 0) close(job->pollFd);
+    job->pollFd = -1;
+
+    struct timespec now = {0, 0};
+    while(sigisemptyset(&job->signals) == 0 && sigtimedwait(&job->signals, NULL, &now) > 0);   // Swallow a late signal before unblocking it.
+    pthread_sigmask(SIG_SETMASK, &job->previousMask, NULL);
+    job->running = false;
+}
+
+/*
+Function runs a whole scan on the calling thread, which drives engine zero until the job runs dry.
+Params:
+    PCPSCAN_JOB job     -       [A scan from CreateScan.]
+Returns nothing.
+*/
+void RunScan(PCPSCAN_JOB job) {
+    if(StartScan(job) == false) return;
+    while(job->stepping == true) job->stepping = EngineStep(&job->engines[0], true);
+    if(job->engineCount > 0) FlushOutput(&job->engines[0].output);
+    FinishScan(job);
+}
+
+/*
+Function releases a scan, finishing it first if it is still running. Its metrics are gone afterwards.
+Params:
+    PCPSCAN_JOB job     -       [The scan to free.]
+Returns nothing.
+*/
+void FreeScan(PCPSCAN_JOB job) {
+    FinishScan(job);
+    if(job->state) munmap(job->state, job->stateSize);
+    if(job->wakeEvent >= 0) close(job->wakeEvent);
+    if(job->rttHistograms) munmap(job->rttHistograms, job->rttHistogramsSize);
+    free(job->metrics);
+    free(job);
+}
+
+/*
+Function prepares to scan the same targets and ports over and over, keeping every port's last result so each
+cycle after the first rescans only part of the range and reports only the ports that opened or closed.
+Params:
+    PCPSCAN_CONFIG      p         -       [Settings for every cycle, kept until the watch is freed.]
+    PCPSCAN_TARGET_LIST targets   -       [The hosts to watch, kept until the watch is freed.]
+    size_t              portStart -       [The start range to begin the port scan.]
+    size_t              portEnd   -       [The end range to finish the port scan.]
+Returns PCPSCAN_WATCH (NULL when the watch could not be set up).
+*/
+PCPSCAN_WATCH CreateWatch(PCPSCAN_CONFIG p, PCPSCAN_TARGET_LIST targets, size_t portStart, size_t portEnd) {
+    if(targets->count == 0 || portStart > portEnd || portEnd > 65535) {
+        ReportNotice(p, CPSCAN_RED, "[Nothing to scan]");
+        return NULL;
+    }
+    if(p->statePath) {                                                          // Each cycle would overwrite it.
+        ReportNotice(p, CPSCAN_ORANGE, "[-state does not apply to a watch, ignoring it]");
+        p->statePath = NULL;
+        p->resume = false;
+    }
+
+    PCPSCAN_WATCH watch = calloc(1, sizeof(CPSCAN_WATCH));
+    if(!watch) {
+        ReportNotice(p, CPSCAN_RED, "[Unable to initialise the watch]");
+        return NULL;
+    }
+    watch->config = p;
+    watch->targets = targets;
+    watch->portStart = portStart;
+    watch->portEnd = portEnd;
+    watch->cellsSize = (targets->count * (portEnd - portStart + 1) + 3) / 4;
+    watch->cells = mmap(NULL, watch->cellsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    watch->lastChange = calloc(targets->count, sizeof(unsigned int));
+    if(watch->cells == MAP_FAILED || !watch->lastChange) {
+        if(watch->cells == MAP_FAILED) watch->cells = NULL;
+        ReportNotice(p, CPSCAN_RED, "[Unable to initialise the watch]");
+        FreeWatch(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+/*
+Function creates the next cycle of a watch. Host names that failed are looked up again every cycle, the others
+once resolveInterval seconds have passed. The previous cycle's scan must be freed first.
+Params:
+    PCPSCAN_WATCH watch -       [The watch.]
+Returns PCPSCAN_JOB (NULL when the scan could not be set up).
+*/
+PCPSCAN_JOB CreateWatchScan(PCPSCAN_WATCH watch) {
+    long long now = GetMonotonicTime();
+    bool refresh = watch->cycle > 0 && watch->config->resolveInterval > 0 && now - watch->resolvedAt >= (long long)watch->config->resolveInterval * 1000000;
+    if(watch->cycle == 0 || refresh == true) watch->resolvedAt = now;
+    for(size_t index = 0; index < watch->targets->count; index++) {              // Names that failed get another lookup, the rest when due.
+        PCPSCAN_TARGET target = &watch->targets->items[index];
+        if(target->name && (target->state == CPSCAN_TARGET_FAILED || (refresh == true && target->state == CPSCAN_TARGET_RESOLVED))) target->state = CPSCAN_TARGET_PENDING;
+    }
+
+    PCPSCAN_JOB job = CreateScan(watch->config, watch->targets, watch->portStart, watch->portEnd);
+    if(!job) return NULL;
+    job->watch = watch;
+    job->watchCycle = watch->cycle++;
+    return job;
+}
+
+/*
+Function releases a watch and every result it kept.
+Params:
+    PCPSCAN_WATCH watch -       [The watch to free.]
+Returns nothing.
+*/
+void FreeWatch(PCPSCAN_WATCH watch) {
+    if(watch->cells) munmap(watch->cells, watch->cellsSize);
+    free(watch->lastChange);
+    free(watch);
+}
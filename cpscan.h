@@ -0,0 +1,184 @@
+#ifndef CPSCAN_H
+#define CPSCAN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define CPSCAN_TERMINAL_RESET "\033[0m"
+#define CPSCAN_DEFAULT_COLOUR(enabled) ((enabled) == true ? CPSCAN_TERMINAL_RESET : "")
+#define CPSCAN_ERRNO_LIMIT 134
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum CPSCAN_PROTOCOL {
+    CPSCAN_TCP,
+    CPSCAN_UDP
+} CPSCAN_PROTOCOL;
+
+typedef enum CPSCAN_PORT_STATE { // The outcome of a single probe.
+    CPSCAN_PORT_OPEN,
+    CPSCAN_PORT_CLOSED,
+    CPSCAN_PORT_FILTERED,
+    CPSCAN_PORT_OPEN_FILTERED   // Udp port that stayed silent, open or dropped by a firewall.
+} CPSCAN_PORT_STATE;
+
+typedef enum CPSCAN_CHANGE {    // How a --watch cycle's result differs from the last one for the port.
+    CPSCAN_CHANGE_NONE,
+    CPSCAN_CHANGE_OPENED,       // Open now, was not before.
+    CPSCAN_CHANGE_CLOSED        // Was open, closed or silent now.
+} CPSCAN_CHANGE;
+
+typedef enum CPSCAN_FORMAT {    // How results are written.
+    CPSCAN_FORMAT_HUMAN,
+    CPSCAN_FORMAT_JSON,
+    CPSCAN_FORMAT_BINARY
+} CPSCAN_FORMAT;
+
+typedef enum CPSCAN_TARGET_STATE { // Where a target is in name resolution.
+    CPSCAN_TARGET_PENDING,
+    CPSCAN_TARGET_RESOLVED,
+    CPSCAN_TARGET_FAILED
+} CPSCAN_TARGET_STATE;
+
+typedef enum CPSCAN_COLOUR {    // Enum for selecting different colour codes.
+    CPSCAN_GREY,
+    CPSCAN_BLUE,
+    CPSCAN_GREEN,
+    CPSCAN_LIGHT_BLUE,
+    CPSCAN_RED,
+    CPSCAN_PURPLE,
+    CPSCAN_ORANGE,
+    CPSCAN_WHITE
+} CPSCAN_COLOUR;
+
+typedef union CPSCAN_ADDRESS {  // Ipv4 or ipv6 destination, sa_family tells them apart.
+    struct sockaddr sa;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+} CPSCAN_ADDRESS, *PCPSCAN_ADDRESS;
+
+typedef struct CPSCAN_TARGET {
+    char *name;                 // Hostname as given, NULL for literal addresses.
+    CPSCAN_ADDRESS address;     // Filled in once resolved, the port is left at zero.
+    int srtt;                   // Smoothed round trip time in microseconds, 0 until the first answer.
+    int rttvar;                 // Round trip time variation in microseconds.
+    int sendGap;                // Microseconds between udp probes to this host, 0 while it keeps up.
+    long long nextSend;         // Monotonic time in microseconds before which the host gets no udp probe.
+    unsigned int nextAlias;     // Next target with the same hostname, 0 ends the chain.
+    bool alias;                 // Repeats an earlier hostname and shares its lookup.
+    bool icmpSeen;              // The host has answered a udp probe with an icmp error.
+    unsigned char state;        // CPSCAN_TARGET_STATE, read and written atomically.
+} CPSCAN_TARGET, *PCPSCAN_TARGET;
+
+typedef struct CPSCAN_RESULT {  // One finished probe, as handed to the result callback.
+    size_t target;              // Index of the target in the order given.
+    const char *name;           // Hostname as given, NULL for literal addresses.
+    const CPSCAN_ADDRESS *address;  // The target's address, the port is left at zero.
+    unsigned short port;
+    CPSCAN_PROTOCOL pt;
+    CPSCAN_PORT_STATE state;
+    int rtt;                    // Smoothed round trip time of the host in microseconds, 0 if unknown.
+    const unsigned char *banner;    // What the service sent with banners on, NULL for nothing.
+    size_t bannerLength;
+    CPSCAN_CHANGE change;       // Always CPSCAN_CHANGE_NONE outside a watch.
+} CPSCAN_RESULT, *PCPSCAN_RESULT;
+
+// Called once per finished probe, closed and filtered ones included. With more than one thread it is called
+// from several threads at once, and the result is only valid until it returns.
+typedef void (*CPSCAN_CALLBACK)(const CPSCAN_RESULT *result, void *context);
+
+typedef struct CPSCAN_CONFIG {
+    CPSCAN_PROTOCOL pt;
+    bool debug;
+    long timeout;               // Probe timeout in ms until a host's round trip time has been measured.
+    size_t retries;             // Extra attempts for probes that get no answer.
+    size_t rate;                // Probes per second across every thread, 0 for no limit.
+    size_t hostRate;            // Probes per second to any single host, 0 for no limit.
+    bool synScan;               // Use raw half-open SYN probes instead of connect().
+    CPSCAN_FORMAT format;       // human, json or binary results.
+    int outputFd;               // Where results are written, -1 to only hand them to the callback.
+    bool progress;              // Print a progress line to stderr every second.
+    const char *statsPath;      // Where the json metrics go at exit, NULL to only dump them to stderr on a signal.
+    const char *statePath;      // Checkpoint file every result is recorded in, NULL for none.
+    bool resume;                // Skip the ports the checkpoint file already has a result for.
+    bool randomize;             // Probe targets and ports in a pseudorandom order.
+    bool banners;               // Read what open tcp ports say before closing them.
+    size_t bannerWindow;        // Banner reads in flight across every thread.
+    size_t concurrency;         // Connects or datagrams in flight across every thread.
+    size_t threads;             // Worker threads, each with its own event loop. The thread driving the scan is one of them.
+    size_t watchSlices;         // A watch cycle rescans 1 in this many quiet ports, open ports and busy hosts every time.
+    size_t resolveInterval;     // Seconds before a watch looks its host names up again, 0 to keep the first answers.
+    FILE *messages;             // Where notices go, NULL to stay quiet.
+    bool colour;                // Colour the notices.
+    int metricsSignal;          // Signal that dumps the metrics while the scan runs, 0 for none. Blocked in every scan thread.
+    CPSCAN_CALLBACK onResult;   // Called for every result, NULL for none.
+    void *resultContext;        // Passed to onResult.
+} CPSCAN_CONFIG, *PCPSCAN_CONFIG;
+
+typedef struct CPSCAN_TARGET_LIST {
+    PCPSCAN_TARGET items;
+    size_t count;
+    size_t capacity;
+    size_t *nameCache;          // Open addressing table of hostname -> first target index + 1.
+    size_t nameCacheSize;
+    size_t nameCount;
+    PCPSCAN_CONFIG config;      // Where notices about bad targets go, NULL to stay quiet.
+} CPSCAN_TARGET_LIST, *PCPSCAN_TARGET_LIST;
+
+typedef struct __attribute__((aligned(64))) CPSCAN_METRICS { // Counters of one thread, on their own cache line. Only the owner writes them.
+    unsigned long long sent;            // Probes put on the wire, retransmits included.
+    unsigned long long retries;         // Retransmits.
+    unsigned long long timeouts;        // Deadlines that passed without an answer.
+    unsigned long long results[4];      // Finished probes by CPSCAN_PORT_STATE.
+    unsigned long long inFlight;        // Probes waiting for an answer.
+    unsigned long long resolved;        // Host names looked up.
+    unsigned long long unresolved;      // Host names that failed to resolve.
+    unsigned long long resumed;         // Probes skipped because the -state file or an earlier watch cycle had their result.
+    unsigned long long banners;         // Open ports that sent something back.
+    unsigned long long errors[CPSCAN_ERRNO_LIMIT];   // Failed syscalls by errno.
+} CPSCAN_METRICS, *PCPSCAN_METRICS;
+
+typedef struct CPSCAN_JOB CPSCAN_JOB, *PCPSCAN_JOB; // A scan in progress, see CreateScan.
+typedef struct CPSCAN_WATCH CPSCAN_WATCH, *PCPSCAN_WATCH; // Results kept between repeated scans, see CreateWatch.
+
+// Notices.
+void ReportNotice(PCPSCAN_CONFIG config, CPSCAN_COLOUR c, const char *format, ...);
+
+// Targets.
+bool ParseTargetSpec(PCPSCAN_TARGET_LIST list, const char *spec);
+bool LoadTargetFile(PCPSCAN_TARGET_LIST list, const char *path);
+void FreeTargetList(PCPSCAN_TARGET_LIST list);
+void FormatTargetAddress(PCPSCAN_TARGET target, char *output);
+
+// Scans: CreateScan, then RunScan, or StartScan, StepScan until it returns false and FinishScan. FreeScan in either case.
+void InitScanConfig(PCPSCAN_CONFIG config);
+PCPSCAN_JOB CreateScan(PCPSCAN_CONFIG config, PCPSCAN_TARGET_LIST targets, size_t portStart, size_t portEnd);
+bool StartScan(PCPSCAN_JOB job);
+int GetScanFd(PCPSCAN_JOB job);
+int GetScanTimeout(PCPSCAN_JOB job);
+bool StepScan(PCPSCAN_JOB job);
+void FinishScan(PCPSCAN_JOB job);
+void RunScan(PCPSCAN_JOB job);
+void FreeScan(PCPSCAN_JOB job);
+
+// Watches: CreateWatch, then one CreateWatchScan per cycle, run and freed like any other scan. After the first
+// cycle only changes are reported. FreeWatch once every scan is freed.
+PCPSCAN_WATCH CreateWatch(PCPSCAN_CONFIG config, PCPSCAN_TARGET_LIST targets, size_t portStart, size_t portEnd);
+PCPSCAN_JOB CreateWatchScan(PCPSCAN_WATCH watch);
+void FreeWatch(PCPSCAN_WATCH watch);
+
+// Metrics.
+void SumMetrics(PCPSCAN_JOB job, PCPSCAN_METRICS total);
+void WriteMetrics(PCPSCAN_JOB job, FILE *file);
+void DumpMetrics(PCPSCAN_JOB job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
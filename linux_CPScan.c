@@ -1,176 +1,71 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+#include <strings.h>
 #include <fcntl.h>
-#include <errno.h>
-#include <netdb.h>
-#include <sys/select.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include "cpscan.h"
 
-#define DEFAULT_TERMINAL_COLOUR "\033[0m"
-
-typedef enum bool {
-    false,
-    true
-} bool;
-
-typedef enum protocol {
-    tcp,
-    udp
-} protocol;
-
-typedef enum colour {           // Enum for selecting different colour codes.
-    grey,
-    blue,
-    green,
-    lightBlue,
-    red,
-    purple,
-    orange,
-    white
-} colour;
-
-// Default constants.
-const size_t DEFAULT_TIMEOUT = 50;
 const size_t DEFAULT_START_PORT = 1;
 const size_t DEFAULT_END_PORT = 1024;
 const size_t MAX_PORT = 65535;
 const char *VERSION = "0.0.2";
 const char *AUTHOR = "liquidlegs";
 
-// An array of colour codes.
-const char *colours[] = {
-    "\x1B[1;30m", "\x1B[1;34m", "\x1B[1;32m", 
-    "\x1B[1;36m", "\x1B[1;31m", "\x1B[1;35m", 
-    "\x1B[1;33m", "\x1B[1;37m"
+enum {                                  // Options without a one letter form.
+    optionDebug = 256,
+    optionProgress,
+    optionRandomize,
+    optionStats,
+    optionState,
+    optionResume,
+    optionSyn,
+    optionBanners,
+    optionBannerWindow,
+    optionRate,
+    optionHostRate,
+    optionProtocol,
+    optionFormat,
+    optionTargetFile,
+    optionWatch,
+    optionWatchSlices,
+    optionWatchResolve
 };
 
-typedef struct PACKET_CONTENTS {
-    char *ipAddress;
-    unsigned short port;
-    protocol pt;
-    bool debug;
-    long timeout;
-} PACKET_CONTENTS, *PPACKET_CONTENTS;
-
-// Forward declarations.
-void ShowSyntax();
-size_t SendSynPacket(PPACKET_CONTENTS config);
-void ResolveDnsAddress(char *dnsQuery, char output[32]);
-void ScanTarget(size_t portStart, size_t portEnd, char *domain, protocol pt, bool debug, size_t timeout);
-bool arePortsCorrect(size_t arg1, size_t arg2);
-
-/*
-Function returns a colours codes as selected by the user.
-Params:
-    colour c        -       [The colour code.]
-Returns const char*
-*/
-const char *clr(colour c) {
-    if(c == grey) return colours[0];
-    else if(c == blue) return colours[1];
-    else if(c == green) return colours[2];
-    else if(c == lightBlue) return colours[3];
-    else if(c == red) return colours[4];
-    else if(c == purple) return colours[5];
-    else if(c == orange) return colours[6];
-    else if(c == white) return colours[7];
-    else return "";
-}
-
-/*
-Function will attempt to connect to a server socket in hope that it may responnd.
-Params:
-    PPACKET_CONTENTS config     -       [Contains info to be sent on the socket.]
-Returns size_t.
-*/
-size_t SendSynPacket(PPACKET_CONTENTS config) {
-    size_t stream = SOCK_STREAM;                                    // Tcp stream.
-    int protocol = IPPROTO_TCP;                                     // Tcp protocol.
-
-    if(config->pt == udp) {                                         // If the udp enum is found on the config param.
-        stream = SOCK_DGRAM;                                        // then set the socket to use Udp.
-        protocol = IPPROTO_UDP;
-    }
-
-    struct sockaddr_in server;                                      // Destination host information.
-    server.sin_addr.s_addr = inet_addr(config->ipAddress);          // Ipaddress as network byte order.
-    server.sin_family = AF_INET;                                    // Uses Ipv4.
-    server.sin_port = htons(config->port);                          // Server port in network byte order.
-
-    int s = socket(AF_INET, stream, protocol);                      // Create the socket.
-    if(s < 0) {
-        printf("%s%s%s", clr(red), "INVALID SOCKET\n", DEFAULT_TERMINAL_COLOUR);
-        return 1;
-    }
-
-    int err = fcntl(s, F_SETFL, O_NONBLOCK);                            // Sets socket to non blocking mode.
-    if(err < 0) {
-        printf("Unable to set socket to non blocking mode\n");
-        return 1;
-    }
-
-    err = connect(s, (struct sockaddr*)&server, sizeof(server));        // Attempt to connect to server.  
-    if(err < 0) {                           
-        if(errno == EINPROGRESS) {                                      // Connecting is in progress.
-            fd_set w, e;
-            FD_ZERO(&w);
-            FD_ZERO(&e);
-            FD_SET(s, &w);                                              // Allow socket to written to.
-            FD_SET(s, &e);                                              // Tells socket how to handle the connection if it fails.
-
-            struct timeval timeout = {0};                               // Setup timeout period for scanning ports.
-            timeout.tv_sec = 0;
-            timeout.tv_usec = config->timeout*1000;                     // timeout is equal to microseconds*1000.
-
-            select(s, NULL, &w, &e, &timeout);
-            size_t counter = 0;                                         // Counts how many times the connect function is called.
-            size_t time = 0;                                            // Controls how many times the connect function can be called before it moves on.
-            while(errno != EISCONN && time < 2) {                       // Keep trying to connect.
-                err = connect(s, (struct sockaddr*)&server, sizeof(server));
-                counter++;
-                if(counter >= 10) {
-                    time++;
-                    counter = 0;
-                }
-            }
-
-            if(errno == EISCONN) {
-                printf("%sOPEN [%hu]%s\n", clr(green), config->port, DEFAULT_TERMINAL_COLOUR);
-                return 0;                                               // Return status success.
-            }
-            else if(errno != EISCONN && time >= 1) {
-                if(config->debug == true) printf("%sCLOSED [%hu]%s\n", clr(red), config->port, DEFAULT_TERMINAL_COLOUR);
-                return 1;                                               // Return status fail.
-            }
-        }
-    }
-
-    return 0;
-}
-
-/*
-Function resolves dns domain names to ip addresses.
-Params:
-    char *dnsQuery      -       [The name of the domain you wish to query.]
-    char output[32]     -       [The buffer that stores the ip address.]
-Returns nothing.
-*/
-void ResolveDnsAddress(char *dnsQuery, char output[32]) {
-    struct hostent *host = NULL;                                // Structure holds the ip address info.
-	struct in_addr **addr = NULL;                           // Structures stores the ip address in its network byte order.
-		
-	host = gethostbyname(dnsQuery);                         // Queries the domain for ip address info.
-    if(host) {
-	    addr = (struct in_addr **)host->h_addr_list;        // Grab the ip address.
-        strcat(output, inet_ntoa(*addr[0]));                    // Fill the output buffer.
-    }
-    else {
-        printf("%s[%s]%s\n", clr(red), "Domain is empty.", DEFAULT_TERMINAL_COLOUR);
-        exit(1);
-    }
-}
+// Single dash and double dash both work, getopt_long_only tries these before the short options.
+const struct option LONG_OPTIONS[] = {
+    {"h", no_argument, NULL, 'h'},
+    {"help", no_argument, NULL, 'h'},
+    {"dbg", no_argument, NULL, optionDebug},
+    {"prog", no_argument, NULL, optionProgress},
+    {"rand", no_argument, NULL, optionRandomize},
+    {"randomize", no_argument, NULL, optionRandomize},
+    {"stats", required_argument, NULL, optionStats},
+    {"state", required_argument, NULL, optionState},
+    {"resume", no_argument, NULL, optionResume},
+    {"sS", no_argument, NULL, optionSyn},
+    {"banners", no_argument, NULL, optionBanners},
+    {"bc", required_argument, NULL, optionBannerWindow},
+    {"t", required_argument, NULL, 't'},
+    {"r", required_argument, NULL, 'r'},
+    {"rate", required_argument, NULL, optionRate},
+    {"hrate", required_argument, NULL, optionHostRate},
+    {"c", required_argument, NULL, 'c'},
+    {"j", required_argument, NULL, 'j'},
+    {"p", required_argument, NULL, 'p'},
+    {"proto", required_argument, NULL, optionProtocol},
+    {"of", required_argument, NULL, optionFormat},
+    {"o", required_argument, NULL, 'o'},
+    {"iL", required_argument, NULL, optionTargetFile},
+    {"watch", required_argument, NULL, optionWatch},
+    {"ws", required_argument, NULL, optionWatchSlices},
+    {"wr", required_argument, NULL, optionWatchResolve},
+    {NULL, 0, NULL, 0}
+};
 
 /*
 Function displays the help menu.
@@ -191,229 +86,226 @@ void ShowSyntax() {
             "  \x1B[1;32m           Version: [%s]\n\n\x1B[1;33m"
             "  ___________________________________Help___________________________________\n\n"
             "             [ -p      ]              <Scan ports within a range>\n"
-            "             [ -proto  ]              <The protocol you want to use>\n"
+            "             [ -iL     ]              <Read targets from a file, - for stdin>\n"
+            "             [ -proto  ]              <The protocol you want to use, tcp or udp>\n"
             "             [ -dbg    ]              <Show debug information>\n"
-            "             [ -t      ]              <Set syn request timeout in ms>\n"
+            "             [ -t      ]              <Timeout in ms until a host's round trip time is known>\n"
+            "             [ -r      ]              <Retransmits for unanswered probes (default 1)>\n"
+            "             [ -rate   ]              <Maximum probes per second across all threads>\n"
+            "             [ -hrate  ]              <Maximum probes per second to any one host>\n"
+            "             [ -o      ]              <Write results to a file instead of stdout>\n"
+            "             [ -of     ]              <Result format: human, json or binary>\n"
+            "             [ -prog   ]              <Show progress and an ETA on stderr>\n"
+            "             [ -stats  ]              <Write scan metrics as json to a file at exit>\n"
+            "             [ -state  ]              <Record every result in a checkpoint file>\n"
+            "             [ -resume ]              <Skip ports the -state file already has results for>\n"
+            "             [ -c      ]              <Max connections in flight (default 4096)>\n"
+            "             [ -j      ]              <Number of worker threads (default 1)>\n"
+            "             [ -sS     ]              <Half-open SYN scan, needs CAP_NET_RAW>\n"
+            "             [ -rand   ]              <Probe hosts and ports in a random order>\n"
+            "             [ -banners]              <Read the banner of every open tcp port>\n"
+            "             [ -bc     ]              <Max banner reads in flight (default 256)>\n"
+            "             [ -watch  ]              <Rescan every N seconds and show only ports that opened or closed>\n"
+            "             [ -ws     ]              <Rescan 1 in N quiet ports per -watch cycle (default 16)>\n"
+            "             [ -wr     ]              <Look host names up again every N seconds in -watch, 0 never (default 300)>\n"
             "             [ -h      ]              <Show this menu>\n\n"
+            "             [Targets]\n"
+            "                host.com  10.0.0.1  10.0.0.0/24  10.0.0.1-50  ::1  2001:db8::/120\n"
+            "                Blocks and ranges up to 65536 addresses, 1048576 targets in all\n\n"
             "             [Examples]\n"
             "                stackmypancakes.com -proto tcp -p 1 1024\n"
             "                doogle.com -dbg -proto udp -p 22 65535\n"
             "                asdf.com -t 200 -proto tcp -p 440 450\n"
             "                friendface.com -t 50 -dbg -p 50 100 -proto tcp\n"
+            "                friendface.com -c 8192 -t 250 -p 1 65535\n"
+            "                friendface.com -j 4 -c 16384 -p 1 65535\n"
+            "                friendface.com -sS -t 500 -p 1 65535\n"
+            "                10.0.0.0/16 -rate 20000 -hrate 100 -p 1 1024\n"
+            "                10.0.0.0/16 -rand -rate 20000 -p 1 1024\n"
+            "                10.0.0.0/24 -banners -of json -p 1 1024\n"
+            "                10.0.0.0/16 -of json -o results.jsonl -p 1 65535\n"
+            "                10.0.0.0/16 -rate 100000 -prog -stats metrics.json -p 80 80\n"
+            "                10.0.0.0/16 -state sweep.state -resume -p 1 65535\n"
+            "                10.0.0.0/24 -watch 300 -of json -p 1 65535\n"
+            "                10.0.0.0/24 friendface.com -iL hosts.txt -p 1 1024\n"
             "  __________________________________________________________________________\n\n",
             AUTHOR, VERSION
     );
 }
 
 /*
-Function runs the main loop for scanning and preparing ports to be scanned.
+Function runs one scan over every target and writes its metrics when asked to.
+Params:
+    PCPSCAN_TARGET_LIST targets   -       [The hosts to scan, host names are resolved while the scan runs.]
+    size_t              portStart -       [The start range to begin the port scan.]
+    size_t              portEnd   -       [The end range to finish the port scan.]
+    PCPSCAN_CONFIG      p         -       [Protocol, timeouts, concurrency, threads and output.]
+Returns nothing.
+*/
+void ScanTargets(PCPSCAN_TARGET_LIST targets, size_t portStart, size_t portEnd, PCPSCAN_CONFIG p) {
+    PCPSCAN_JOB job = CreateScan(p, targets, portStart, portEnd);
+    if(!job) return;
+    RunScan(job);
+    if(p->statsPath) DumpMetrics(job);
+    FreeScan(job);
+}
+
+/*
+Function scans the targets every interval seconds until killed, reporting every result once and then only the
+ports that opened or closed.
 Params:
-    size_t      portStart        -       [The start range to begin the port scan.]
-    size_t      portEnd          -       [The end range to finish the port scan.]
-    char        *domain          -       [The domain name to be resolved.]
-    protocol    pt               -       [The protocol to use in the scan. tcp/udp.]
-    bool        debug            -       [Displays debug information such as closed ports]
-    long        timeout          -       [The maxium amount of time a port should be scanned before moving on to the next.]
+    PCPSCAN_TARGET_LIST targets   -       [The hosts to watch.]
+    size_t              portStart -       [The start range to begin the port scan.]
+    size_t              portEnd   -       [The end range to finish the port scan.]
+    PCPSCAN_CONFIG      p         -       [Protocol, timeouts, concurrency, threads and output.]
+    long                interval  -       [Seconds from the start of one cycle to the start of the next.]
 Returns nothing.
 */
-void ScanTarget(size_t portStart, size_t portEnd, char *domain, protocol pt, bool debug, size_t timeout) {
-    PACKET_CONTENTS p;                                                          // Holds packet information to be sent on the socket.
-    char dnsBuf[32] = {0};                                                      // Holds the ip address.
-    if(debug == true) printf("%s[%s]%s\n", clr(orange), "Resolving domain name", DEFAULT_TERMINAL_COLOUR); 
-    ResolveDnsAddress(domain, dnsBuf);                                          // Resolves dns name to ip address.
-    p.ipAddress = dnsBuf;                                                       // Fills structure with ip address.
-    
-    if(debug == true) printf("%s[%s] -> %s[%s]%s\n", clr(orange), domain, clr(lightBlue), dnsBuf, DEFAULT_TERMINAL_COLOUR);
-    if(timeout <= 30) p.timeout = DEFAULT_TIMEOUT;
-    
-    p.pt = pt;
-    p.debug = debug;
-    p.timeout = timeout;
-    for(unsigned int index = portStart; index <= portEnd; index ++) {                           // Scan ports with in set port range.
-        p.port = index;                                                                         // The port.
-        size_t err = SendSynPacket(&p);                                                         // Send syn packets to each port.
-        if(debug == true) printf("%sSendPacket Status [%lu]%s\n", clr(grey), err, DEFAULT_TERMINAL_COLOUR);
+void WatchTargets(PCPSCAN_TARGET_LIST targets, size_t portStart, size_t portEnd, PCPSCAN_CONFIG p, long interval) {
+    PCPSCAN_WATCH watch = CreateWatch(p, targets, portStart, portEnd);
+    if(!watch) return;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(true) {
+        PCPSCAN_JOB job = CreateWatchScan(watch);
+        if(!job) break;
+        RunScan(job);
+        if(p->statsPath) DumpMetrics(job);
+        FreeScan(job);
+
+        next.tv_sec += interval;                                                 // Cycles start on a fixed schedule unless one overruns.
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)) next = now;
+        else clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
     }
+    FreeWatch(watch);
 }
 
 /*
 Function checks if the port range makes sense.
 Params:
-    size_t arg1     -       [The starting port range.]
-    size_t arg2     -       [The ending port range.]
+    PCPSCAN_CONFIG p    -       [Where complaints go.]
+    size_t arg1         -       [The starting port range.]
+    size_t arg2         -       [The ending port range.]
 Returns BOOL.
 */
-bool arePortsCorrect(size_t arg1, size_t arg2) {
-    if(arg1 > arg2) printf("%s[StartPort (%lu) cannot be greater than EndPort (%lu)]%s\n", clr(red), arg1, arg2, DEFAULT_TERMINAL_COLOUR);
-    else if(arg2 < arg1) printf("%s[StartPort (%lu) cannot be less than EndPort (%lu)]%s\n", clr(red), arg2, arg1, DEFAULT_TERMINAL_COLOUR);
-    else if(arg2 > 65535) printf("%s[EndPort (%lu) You may not scan ports greater than %lu]%s\n", clr(red), arg2, MAX_PORT, DEFAULT_TERMINAL_COLOUR);
-    else if(arg1 <= arg2 && arg2 >= arg1) return true;
+bool arePortsCorrect(PCPSCAN_CONFIG p, size_t arg1, size_t arg2) {
+    if(arg1 > arg2) ReportNotice(p, CPSCAN_RED, "[StartPort (%lu) cannot be greater than EndPort (%lu)]", arg1, arg2);
+    else if(arg2 > MAX_PORT) ReportNotice(p, CPSCAN_RED, "[EndPort (%lu) You may not scan ports greater than %lu]", arg2, MAX_PORT);
+    else return true;
     return false;
 }
 
 int main(int argc, char *argv[]) {
-    long timeout_arg = DEFAULT_TIMEOUT;                                          // The default timeout value.
+    CPSCAN_CONFIG p;                                                             // Scan settings shared by every probe.
     size_t startPt = DEFAULT_START_PORT;                                         // The default start port.
     size_t endPt = DEFAULT_END_PORT;                                             // The default end port.
-    bool ports = false;                                                          // Controls whether the port scan will begin.
-    
-    if(argc <= 1) ShowSyntax();
-    else if(argc == 2) {
-        if(strlen(argv[1]) > 0 && strcasecmp("-h", argv[1]) == 0) ShowSyntax();
-        else if(strlen(argv[1]) > 0 && strcasecmp("-h", argv[1]) != 0) {
-            ScanTarget(DEFAULT_START_PORT, DEFAULT_END_PORT, argv[1], tcp, false, DEFAULT_TIMEOUT);
-        }
-        else ShowSyntax();
-    }
-    else if(argc == 3) {
-        if(strcasecmp("-dbg", argv[2]) == 0) {
-            ScanTarget(DEFAULT_START_PORT, DEFAULT_END_PORT, argv[1], tcp, true, DEFAULT_TIMEOUT);
-        }
-        else ShowSyntax();
-    }
-    else if(argc == 4) {
-        if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0) {
-            timeout_arg = atol(argv[3]);
-            ScanTarget(DEFAULT_START_PORT, DEFAULT_END_PORT, argv[1], tcp, true, timeout_arg);
-        }
-        else ShowSyntax();
-    }
-    else if(argc == 5) {
-        if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0 && strcasecmp("-dbg", argv[4]) == 0) {
-            timeout_arg = atol(argv[3]);
-            ScanTarget(DEFAULT_START_PORT, DEFAULT_END_PORT, argv[1], tcp, true, timeout_arg);
-        }
-        else if(strcasecmp("-dbg", argv[2]) == 0 && strcasecmp("-t", argv[3]) == 0 && strlen(argv[4]) > 0) {
-            timeout_arg = atol(argv[4]);
-            ScanTarget(DEFAULT_START_PORT, DEFAULT_END_PORT, argv[1], tcp, true, timeout_arg);
-        }
-        else if(strcasecmp("-p", argv[2]) == 0 && strlen(argv[3]) > 0 && strlen(argv[4]) > 0) {
-            startPt = atoll(argv[3]);
-            endPt = atoll(argv[4]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, DEFAULT_TIMEOUT);
-        }
-        else ShowSyntax();
-    }
-    else if(argc == 6) {
-        if(strcasecmp("-dbg", argv[2]) == 0 && strcasecmp("-p", argv[3]) == 0 && strlen(argv[4]) > 0 && strlen(argv[5]) > 0) {
-            startPt = atoll(argv[4]);
-            endPt = atoll(argv[5]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, DEFAULT_TIMEOUT);
+    InitScanConfig(&p);                                                          // Tcp connect scan, default timeout, retries and concurrency.
+    p.outputFd = STDOUT_FILENO;                                                  // Results go to stdout unless -o is given.
+    p.messages = stdout;
+    p.colour = isatty(STDOUT_FILENO) == 1;                                       // Plain text when piped.
+    p.metricsSignal = SIGUSR1;
+    sigset_t signals;                                                            // Blocked until exit, so a late SIGUSR1 never kills us once a scan is over.
+    sigemptyset(&signals);
+    sigaddset(&signals, p.metricsSignal);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    CPSCAN_TARGET_LIST targets = {0};                                            // The hosts to scan.
+    targets.config = &p;
+    bool validTargets = true;                                                    // Cleared by any target that fails to parse.
+    bool validOptions = true;                                                    // Cleared by anything getopt does not know.
+    long watchInterval = 0;                                                      // Seconds between -watch cycles, 0 to scan once.
+
+    opterr = 0;                                                                  // The help menu says it better.
+    int option;
+    while(validOptions == true && (option = getopt_long_only(argc, argv, "-", LONG_OPTIONS, NULL)) != -1) {
+        switch(option) {
+            case 1:                                                              // Anything that is not an option is a target.
+                if(ParseTargetSpec(&targets, optarg) == false) {
+                    ReportNotice(&p, CPSCAN_RED, "[Invalid target %s]", optarg);
+                    validTargets = false;
+                }
+                break;
+            case optionDebug: p.debug = true; break;
+            case optionProgress: p.progress = true; break;
+            case optionRandomize: p.randomize = true; break;
+            case optionStats: p.statsPath = optarg; break;
+            case optionState: p.statePath = optarg; break;
+            case optionResume: p.resume = true; break;
+            case optionSyn: p.synScan = true; break;
+            case optionBanners: p.banners = true; break;
+            case optionBannerWindow: p.bannerWindow = atoll(optarg); break;
+            case 't': p.timeout = atol(optarg); break;
+            case 'r': p.retries = atoll(optarg); break;
+            case optionRate: p.rate = atoll(optarg); break;
+            case optionHostRate: p.hostRate = atoll(optarg); break;
+            case 'c': p.concurrency = atoll(optarg); break;
+            case 'j': p.threads = atoll(optarg); break;
+            case 'p':                                                            // Takes the start and the end port.
+                if(optind >= argc) {
+                    validOptions = false;
+                    break;
+                }
+                startPt = atoll(optarg);
+                endPt = atoll(argv[optind++]);
+                break;
+            case optionProtocol:
+                if(strcasecmp("tcp", optarg) == 0) p.pt = CPSCAN_TCP;
+                else if(strcasecmp("udp", optarg) == 0) p.pt = CPSCAN_UDP;
+                else validOptions = false;
+                break;
+            case optionFormat:
+                if(strcasecmp("human", optarg) == 0) p.format = CPSCAN_FORMAT_HUMAN;
+                else if(strcasecmp("json", optarg) == 0) p.format = CPSCAN_FORMAT_JSON;
+                else if(strcasecmp("binary", optarg) == 0) p.format = CPSCAN_FORMAT_BINARY;
+                else validOptions = false;
+                break;
+            case 'o':
+                if(p.outputFd != STDOUT_FILENO) close(p.outputFd);
+                p.outputFd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if(p.outputFd < 0) {
+                    ReportNotice(&p, CPSCAN_RED, "[Unable to open output file %s]", optarg);
+                    FreeTargetList(&targets);
+                    return 1;
+                }
+                break;
+            case optionWatch:
+                watchInterval = atol(optarg);
+                if(watchInterval <= 0) validOptions = false;
+                break;
+            case optionWatchSlices: p.watchSlices = atoll(optarg); break;
+            case optionWatchResolve: p.resolveInterval = atoll(optarg); break;
+            case optionTargetFile:
+                if(LoadTargetFile(&targets, optarg) == false) validTargets = false;
+                break;
+            default: validOptions = false; break;                               // -h, unknown options and missing arguments.
         }
-        else ShowSyntax();
     }
-    else if(argc == 7) {
-        if(strcasecmp("-p", argv[2]) == 0 && strlen(argv[3]) > 0 && strlen(argv[4]) > 0 && strcasecmp("-proto", argv[5]) == 0 && strcasecmp("tcp", argv[6]) == 0) {
-            startPt = atoll(argv[3]);
-            endPt = atoll(argv[4]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, DEFAULT_TIMEOUT);
-        }
-        else if(strcasecmp("-p", argv[2]) == 0 && strlen(argv[3]) > 0 && strlen(argv[4]) > 0 && strcasecmp("-proto", argv[5]) == 0 && strcasecmp("udp", argv[6]) == 0) {
-            startPt = atoll(argv[3]);
-            endPt = atoll(argv[4]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], udp, true, DEFAULT_TIMEOUT);
-        }
-        else if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0 && strcasecmp("-p", argv[4]) == 0 && strlen(argv[5]) > 0 && strlen(argv[6]) > 0) {
-            startPt = atoll(argv[5]);
-            endPt = atoll(argv[6]);
-            timeout_arg = atol(argv[3]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, timeout_arg);
-        }
-        else ShowSyntax();
+    if(validOptions == false) {
+        ShowSyntax();
+        FreeTargetList(&targets);
+        if(p.outputFd != STDOUT_FILENO) close(p.outputFd);
+        return 0;
     }
-    else if(argc == 8) {
-        if(strcasecmp("-dbg", argv[2]) && strcasecmp("-p", argv[3]) == 0 && strlen(argv[4]) > 0 && strlen(argv[5]) > 0 && strcasecmp("-proto", argv[6]) == 0 && 
-        strcasecmp("tcp", argv[7]) == 0) {
-            startPt = atoll(argv[4]);
-            endPt = atoll(argv[5]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, DEFAULT_TIMEOUT);
-        }
-        else if(strcasecmp("-dbg", argv[2]) && strcasecmp("-p", argv[3]) == 0 && strlen(argv[4]) > 0 && strlen(argv[5]) > 0 && strcasecmp("-proto", argv[6]) == 0 && 
-        strcasecmp("udp", argv[7]) == 0) {
-            startPt = atoll(argv[4]);
-            endPt = atoll(argv[5]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], udp, true, DEFAULT_TIMEOUT);
-        }
-        else if(strcasecmp("-dbg", argv[2]) == 0 && strcasecmp("-t", argv[3]) == 0 && strlen(argv[4]) > 0 && strcasecmp("-p", argv[5]) == 0 && strlen(argv[6]) > 0 &&
-        strlen(argv[7]) > 0) {
-            startPt = atoll(argv[6]);
-            endPt = atoll(argv[7]);
-            timeout_arg = atol(argv[4]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, timeout_arg);
-        }
-        else if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0 && strcasecmp("-dbg", argv[4]) == 0 && strcasecmp("-p", argv[5]) == 0 && strlen(argv[6]) > 0 &&
-        strlen(argv[7]) > 0) {
-            startPt = atoll(argv[6]);
-            endPt = atoll(argv[7]);
-            timeout_arg = atol(argv[3]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, timeout_arg);
-        }
-        else ShowSyntax();
+
+    if(p.format != CPSCAN_FORMAT_HUMAN && p.outputFd == STDOUT_FILENO) {         // Keep notices out of the result stream.
+        p.messages = stderr;
+        p.colour = isatty(STDERR_FILENO) == 1;
     }
-    else if(argc == 9) {
-        if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0 && strcasecmp("-p", argv[4]) == 0 && strlen(argv[5]) > 0 && strlen(argv[6]) > 0 && strcasecmp("-proto", argv[7]) == 0 && 
-        strcasecmp("tcp", argv[8]) == 0) {
-            startPt = atoll(argv[5]);
-            endPt = atoll(argv[6]);
-            timeout_arg = atol(argv[3]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, false, timeout_arg);
-        }
-        else if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0 && strcasecmp("-p", argv[4]) == 0 && strlen(argv[5]) > 0 && strlen(argv[6]) > 0 && strcasecmp("-proto", argv[7]) == 0 && 
-        strcasecmp("udp", argv[8]) == 0) {
-            startPt = atoll(argv[5]);
-            endPt = atoll(argv[6]);
-            timeout_arg = atol(argv[3]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], udp, false, timeout_arg);
-        }
-        else ShowSyntax();
+
+    if(p.resume == true && !p.statePath) {
+        ReportNotice(&p, CPSCAN_RED, "[-resume needs a -state file]");
+        validTargets = false;
     }
-    else if(argc == 10) {
-        if(strcasecmp("-dbg", argv[2]) == 0 && strcasecmp("-t", argv[3]) == 0 && strlen(argv[4]) > 0 && strcasecmp("-p", argv[5]) == 0 && strlen(argv[6]) > 0 && strlen(argv[7]) > 0 &&
-        strcasecmp("-proto", argv[8]) == 0 && strcasecmp("tcp", argv[9]) == 0) {
-            startPt = atoll(argv[6]);
-            endPt = atoll(argv[7]);
-            timeout_arg = atol(argv[4]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, timeout_arg);
-        }
-        else if(strcasecmp("-dbg", argv[2]) == 0 && strcasecmp("-t", argv[3]) == 0 && strlen(argv[4]) > 0 && strcasecmp("-p", argv[5]) == 0 && strlen(argv[6]) > 0 && strlen(argv[7]) > 0 &&
-        strcasecmp("-proto", argv[8]) == 0 && strcasecmp("udp", argv[9]) == 0) {
-            startPt = atoll(argv[6]);
-            endPt = atoll(argv[7]);
-            timeout_arg = atol(argv[4]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], udp, true, timeout_arg);
-        }
-        else if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0 && strcasecmp("-dbg", argv[4]) == 0 && strcasecmp("-p", argv[5]) == 0 && strlen(argv[6]) > 0 && strlen(argv[7]) > 0 &&
-        strcasecmp("-proto", argv[8]) == 0 && strcasecmp("tcp", argv[9]) == 0) {
-            startPt = atoll(argv[6]);
-            endPt = atoll(argv[7]);
-            timeout_arg = atol(argv[3]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], tcp, true, timeout_arg);
-        }
-        else if(strcasecmp("-t", argv[2]) == 0 && strlen(argv[3]) > 0 && strcasecmp("-dbg", argv[4]) == 0 && strcasecmp("-p", argv[5]) == 0 && strlen(argv[6]) > 0 && strlen(argv[7]) > 0 &&
-        strcasecmp("-proto", argv[8]) == 0 && strcasecmp("udp", argv[9]) == 0) {
-            startPt = atoll(argv[6]);
-            endPt = atoll(argv[7]);
-            timeout_arg = atol(argv[3]);
-            ports = arePortsCorrect(startPt, endPt);
-            if(ports == true) ScanTarget(startPt, endPt, argv[1], udp, true, timeout_arg);
-        }
-        else ShowSyntax();
+
+    if(validTargets == true && targets.count == 0) ShowSyntax();
+    else if(validTargets == true && arePortsCorrect(&p, startPt, endPt) == true) {
+        if(watchInterval > 0) WatchTargets(&targets, startPt, endPt, &p, watchInterval);
+        else ScanTargets(&targets, startPt, endPt, &p);
     }
-    else if(argc > 10) ShowSyntax();
 
+    FreeTargetList(&targets);
+    if(p.outputFd != STDOUT_FILENO) close(p.outputFd);
     return 0;
 }